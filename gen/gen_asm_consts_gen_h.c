@@ -43,6 +43,13 @@ int main(void)
 	printf("#define CTX__JIT_FRAGMENT_SAVED_ESP (0x%lx)\n", (long)offsetof(thread_ctx_t, jit_fragment_saved_esp));
 	printf("#define CTX__IJMP_TAINT (0x%lx)\n", (long)offsetof(thread_ctx_t, ijmp_taint));
 	printf("#define CTX__FLAGS_TMP (0x%lx)\n", (long)offsetof(thread_ctx_t, flags_tmp));
+	printf("#define CTX__QUIESCENT (0x%lx)\n", (long)offsetof(thread_ctx_t, quiescent));
+	printf("#define CTX__JIT_EPOCH_SEEN (0x%lx)\n", (long)offsetof(thread_ctx_t, jit_epoch_seen));
+	printf("#define CTX__PURGE_SEEN (0x%lx)\n", (long)offsetof(thread_ctx_t, purge_seen));
+	printf("#define CTX__SYNC_PURGES_SEEN (0x%lx)\n", (long)offsetof(thread_ctx_t, sync_purges_seen));
+	printf("#define CTX__JMP_CACHE_HITS (0x%lx)\n", (long)offsetof(thread_ctx_t, jmp_cache_hits));
+	printf("#define CTX__JMP_CACHE_MISSES (0x%lx)\n", (long)offsetof(thread_ctx_t, jmp_cache_misses));
+	printf("#define JMP_CACHE_WAYS (0x%lx)\n", (long)JMP_CACHE_WAYS);
 	printf("#define CTX__MY_ADDR (0x%lx)\n", (long)offsetof(thread_ctx_t, my_addr));
 	printf("#define CTX__SIZE (0x%lx)\n", (long)sizeof(thread_ctx_t));
 	assert( (sizeof(thread_ctx_t) & 0xfff) == 0);
@@ -50,6 +57,8 @@ int main(void)
 	assert( (offsetof(thread_ctx_t, sigwrap_stack) & 0xfff) == 0);
 	assert( (offsetof(thread_ctx_t, jit_fragment_page) & 0xfff) == 0);
 	assert( (offsetof(thread_ctx_t, scratch_stack) & 0xfff) == 0);
+	assert( (JMP_CACHE_BITS == 16) && (JMP_CACHE_WAYS <= 8) &&
+	        ((JMP_CACHE_WAYS & (JMP_CACHE_WAYS-1)) == 0) );
 
 	exit(EXIT_SUCCESS);
 }
@@ -16,6 +16,8 @@
  * limitations under the License.
  */
 
+#include <string.h>
+#include <sys/mman.h>
 
 #include "lib.h"
 #include "mm.h"
@@ -27,6 +29,9 @@
 #include "codemap.h"
 #include "runtime.h"
 #include "threads.h"
+#include "jit_cache.h"
+#include "stats.h"
+#include "syscalls.h"
 
 #define MAX_CODEMAPS (32768)
 
@@ -37,38 +42,369 @@ static code_map_t codemaps[MAX_CODEMAPS];
 static unsigned n_codemaps = 0;
 static long codemap_lock=0;
 
+/* Indices in codemaps[] of the maps with jit code, sorted by jit_addr,
+ * so that jit code can be mapped back to its map with a binary search.
+ */
+static unsigned jit_index[MAX_CODEMAPS];
+static unsigned n_jit_index = 0;
+
+/* position of the last map in jit_index with its jit code at or
+ * before jit_addr, -1 if there is none
+ */
+static int jit_index_find(char *jit_addr)
+{
+	unsigned lo = 0, hi = n_jit_index, mid;
+
+	while (lo < hi)
+	{
+		mid = (lo+hi)/2;
+		if ( (unsigned long)codemaps[jit_index[mid]].jit_addr <= (unsigned long)jit_addr )
+			lo = mid+1;
+		else
+			hi = mid;
+	}
+
+	return (int)lo-1;
+}
+
+static void jit_index_add(unsigned int i)
+{
+	int j;
+
+	for (j=n_jit_index; j>0; j--)
+		if ( (unsigned long)codemaps[i].jit_addr < (unsigned long)codemaps[jit_index[j-1]].jit_addr )
+			jit_index[j] = jit_index[j-1];
+		else
+			break;
+
+	jit_index[j] = i;
+	n_jit_index++;
+}
+
+static void jit_index_del(unsigned int i)
+{
+	int j = jit_index_find(codemaps[i].jit_addr);
+
+	if ( (j < 0) || (jit_index[j] != i) )
+		return;
+
+	for (n_jit_index--; j<(int)n_jit_index; j++)
+		jit_index[j] = jit_index[j+1];
+}
+
+/* codemaps[] entries from i on moved by delta */
+static void jit_index_shift(unsigned int i, int delta)
+{
+	unsigned j;
+
+	for (j=0; j<n_jit_index; j++)
+		if (jit_index[j] >= i)
+			jit_index[j] += delta;
+}
+
+/* Jit code of removed maps which may still be in other threads' jump
+ * caches, freed once they have purged it.
+ */
+#define MAX_DEFERRED_FREES (64)
+
+static struct { char *jit_addr; unsigned long gen; } deferred[MAX_DEFERRED_FREES];
+static unsigned n_deferred = 0;
+
+static void reclaim_jit_code(void)
+{
+	unsigned i, j;
+
+	for (i=0, j=0; i<n_deferred; i++)
+		if (caches_purged(deferred[i].gen))
+			jit_mem_free(deferred[i].jit_addr);
+		else
+			deferred[j++] = deferred[i];
+
+	n_deferred = j;
+}
+
+static int defer_jit_free_unlocked(char *addr, unsigned long len, char *jit_addr)
+{
+	reclaim_jit_code();
+
+	if (n_deferred == MAX_DEFERRED_FREES)
+		return -1;
+
+	deferred[n_deferred].jit_addr = jit_addr;
+	deferred[n_deferred].gen = purge_caches_lazy(addr, len);
+	n_deferred++;
+	return 0;
+}
+
+/* Frees jit_addr, holding the code for [addr, addr+len), once no thread
+ * can be using it anymore. Returns -1 if too many frees are pending.
+ */
+int defer_jit_free(char *addr, unsigned long len, char *jit_addr)
+{
+	mutex_lock(&codemap_lock);
+	int ret = defer_jit_free_unlocked(addr, len, jit_addr);
+	mutex_unlock(&codemap_lock);
+	return ret;
+}
+
 static void clear_code_map(char *addr, unsigned long len, char *jit_addr)
 {
-	jit_mem_free(jit_addr); /* PROT_NONE all the things  */
-	purge_caches(addr, len); /* remove all cache mappings from each thread's caches */
+	if (defer_jit_free_unlocked(addr, len, jit_addr) < 0)
+	{
+		jit_mem_free(jit_addr); /* PROT_NONE all the things  */
+		purge_caches(addr, len); /* remove all cache mappings from each thread's caches */
+	}
 }
 
 static void del_code_map(unsigned int i)
 {
 	code_map_t orig = codemaps[i];
+
+	if (orig.jit_addr)
+		jit_index_del(i);
+
+	jit_index_shift(i+1, -1);
+
 	for (; i<n_codemaps; i++)
 		codemaps[i] = codemaps[i+1];
 
 	n_codemaps--;
 
 	if (orig.jit_addr)
+	{
+		jit_cache_flush(&orig);
 		clear_code_map(orig.addr, orig.len, orig.jit_addr);
+		stats.jit_maps_discarded++;
+	}
 }
 
-code_map_t *find_code_map(char *addr)
+/* true if addr lies in map, but not in one of its holes */
+int code_map_contains(code_map_t *map, char *addr)
 {
-	mutex_lock(&codemap_lock);
+	unsigned long i;
+
+	if (!contains(map->addr, map->len, addr))
+		return 0;
+
+	for (i=0; i<map->n_holes; i++)
+		if (contains(map->holes[i].addr, map->holes[i].len, addr))
+			return 0;
 
+	return 1;
+}
+
+/* Gets the part of map around addr which is not interrupted by holes,
+ * code in different segments is translated as if in different maps.
+ */
+void code_map_segment(code_map_t *map, char *addr, char **seg, unsigned long *seg_len)
+{
+	char *start = map->addr, *end = &map->addr[map->len];
+	unsigned long i;
+
+	for (i=0; i<map->n_holes; i++)
+	{
+		char *h_start = map->holes[i].addr,
+		     *h_end = &h_start[map->holes[i].len];
+
+		if ( (unsigned long)h_end <= (unsigned long)addr )
+			start = h_end;
+		else
+		{
+			end = h_start;
+			break;
+		}
+	}
+
+	*seg = start;
+	*seg_len = end-start;
+}
+
+/* Adds [addr, addr+len) to a sorted list of n ranges, merging it with
+ * ranges it overlaps or touches. The list needs room for n+1 ranges,
+ * returns the new number of ranges.
+ */
+static unsigned long add_range(code_range_t *list, unsigned long n,
+                               char *addr, unsigned long len)
+{
+	unsigned long start = (unsigned long)addr, end = start+len, i, j;
+
+	for (i=0, j=0; i<n; i++)
+	{
+		unsigned long r_start = (unsigned long)list[i].addr,
+		              r_end = r_start+list[i].len;
+
+		if ( (r_end < start) || (r_start > end) )
+			list[j++] = list[i];
+		else
+		{
+			start = r_start < start ? r_start : start;
+			end = r_end > end ? r_end : end;
+		}
+	}
+
+	for (i=j; (i>0) && ((unsigned long)list[i-1].addr > start); i--)
+		list[i] = list[i-1];
+
+	list[i] = (code_range_t){ .addr = (char *)start, .len = end-start };
+
+	return j+1;
+}
+
+/* Invalidates the code of map in [addr, addr+len) by adding a hole,
+ * returns -1 if the map has to be split up instead.
+ */
+static int punch_hole(code_map_t *map, char *addr, unsigned long len)
+{
+	code_range_t holes[MAX_CODEMAP_HOLES+1];
+	unsigned long start = (unsigned long)addr, end = start+len,
+	              m_start = (unsigned long)map->addr, m_end = m_start+map->len, n;
+
+	if (start < m_start)
+		start = m_start;
+	if (end > m_end)
+		end = m_end;
+
+	memcpy(holes, map->holes, map->n_holes*sizeof(code_range_t));
+	n = add_range(holes, map->n_holes, (char *)start, end-start);
+
+	if ( (n > MAX_CODEMAP_HOLES) || (holes[0].len == map->len) )
+		return -1;
+
+	/* the code before the change is still what the map was hashed as */
+	jit_cache_flush(map);
+	map->nocache = 1;
+
+	memcpy(map->holes, holes, n*sizeof(code_range_t));
+	map->n_holes = n;
+
+	if (map->jit_addr)
+		return jit_invalidate_range(map, (char *)start, end-start);
+
+	return 0;
+}
+
+/* Undoes punch_hole() when code becomes executable again. */
+static int fill_hole(code_map_t *map, char *addr, unsigned long len)
+{
+	code_range_t holes[MAX_CODEMAP_HOLES+1];
+	unsigned long i, n = 0;
+
+	for (i=0; i<map->n_holes; i++)
+		if ( contains(map->holes[i].addr, map->holes[i].len, addr) &&
+		     contains(map->holes[i].addr, map->holes[i].len, &addr[len-1]) )
+			break;
+
+	if (i == map->n_holes)
+		return -1;
+
+	char *h_start = map->holes[i].addr, *h_end = &h_start[map->holes[i].len];
+
+	memcpy(holes, map->holes, i*sizeof(code_range_t));
+	memcpy(&holes[i], &map->holes[i+1], (map->n_holes-i-1)*sizeof(code_range_t));
+	n = map->n_holes-1;
+
+	if (addr > h_start)
+		n = add_range(holes, n, h_start, addr-h_start);
+	if (&addr[len] < h_end)
+		n = add_range(holes, n, &addr[len], h_end-&addr[len]);
+
+	if (n > MAX_CODEMAP_HOLES)
+		return -1;
+
+	memcpy(map->holes, holes, n*sizeof(code_range_t));
+	map->n_holes = n;
+
+	return 0;
+}
+
+/* Looks for a map with a hole for this part of the same file. mprotect()
+ * does not know about files, it passes all zeroes.
+ */
+static int refill_hole(char *addr, unsigned long len, unsigned long long inode,
+                                                      unsigned long long dev,
+                                                      unsigned long mtime,
+                                                      unsigned long pgoffset,
+                                                      int writable)
+{
 	unsigned int i;
-	code_map_t *map = NULL;
 
 	for (i=0; i<n_codemaps; i++)
-		if (contains(codemaps[i].addr, codemaps[i].len, addr))
+	{
+		code_map_t *map = &codemaps[i];
+
+		if ( !contains(map->addr, map->len, addr) || (map->writable != writable) )
+			continue;
+
+		if ( ( (inode|dev|mtime|pgoffset) == 0 ) ||
+		     ( (map->inode == inode) && (map->dev == dev) &&
+		       (map->mtime == mtime) &&
+		       (map->pgoffset + (addr-map->addr)/4096 == pgoffset) ) )
+			return fill_hole(map, addr, len);
+	}
+
+	return -1;
+}
+
+static void add_code_map(code_map_t *map);
+
+/* Replaces map i by new maps for its parts outside of [addr, addr+len)
+ * and its holes, the jit code is thrown away.
+ */
+static void split_code_map(unsigned int i, char *addr, unsigned long len)
+{
+	code_map_t map = codemaps[i];
+	code_range_t holes[MAX_CODEMAP_HOLES+1];
+	unsigned long start = (unsigned long)map.addr,
+	              m_end = start+map.len, end, j, n;
+
+	memcpy(holes, map.holes, map.n_holes*sizeof(code_range_t));
+	n = add_range(holes, map.n_holes, addr, len);
+
+	del_code_map(i);
+
+	code_map_t piece = map;
+	piece.jit_addr = NULL;
+	piece.jit_len = 0;
+	piece.hash = 0;
+	piece.saved_len = 0;
+	piece.n_holes = 0;
+	piece.nocache = map.writable;
+
+	for (j=0; j<=n; j++)
+	{
+		end = (j < n) ? (unsigned long)holes[j].addr : m_end;
+
+		if (end > m_end)
+			end = m_end;
+
+		if (end > start)
 		{
-			map = &codemaps[i];
-			break;
+			piece.addr = (char *)start;
+			piece.len = end-start;
+			piece.pgoffset = map.pgoffset + (start-(unsigned long)map.addr)/4096;
+			add_code_map(&piece);
 		}
 
+		if ( (j < n) && ((unsigned long)&holes[j].addr[holes[j].len] > start) )
+			start = (unsigned long)&holes[j].addr[holes[j].len];
+	}
+}
+
+static code_map_t *find_code_map_unlocked(char *addr)
+{
+	unsigned int i;
+
+	for (i=0; i<n_codemaps; i++)
+		if (code_map_contains(&codemaps[i], addr))
+			return &codemaps[i];
+
+	return NULL;
+}
+
+code_map_t *find_code_map(char *addr)
+{
+	mutex_lock(&codemap_lock);
+	code_map_t *map = find_code_map_unlocked(addr);
 	mutex_unlock(&codemap_lock);
 
 	return map;
@@ -78,21 +414,38 @@ code_map_t *find_jit_code_map(char *jit_addr)
 {
 	mutex_lock(&codemap_lock);
 
-	unsigned int i;
+	int j = jit_index_find(jit_addr);
 	code_map_t *map = NULL;
 
-	for (i=0; i<n_codemaps; i++)
-		if (contains(codemaps[i].jit_addr, codemaps[i].jit_len, jit_addr))
-		{
-			map = &codemaps[i];
-			break;
-		}
+	if ( (j >= 0) && contains(codemaps[jit_index[j]].jit_addr,
+	                          codemaps[jit_index[j]].jit_len, jit_addr) )
+		map = &codemaps[jit_index[j]];
 
 	mutex_unlock(&codemap_lock);
 
 	return map;
 }
 
+/* Sets the jit code of map, which may be NULL, and keeps the reverse
+ * lookup index up to date.
+ */
+void code_map_set_jit(code_map_t *map, char *jit_addr)
+{
+	unsigned int i = map-codemaps;
+
+	mutex_lock(&codemap_lock);
+
+	if (map->jit_addr)
+		jit_index_del(i);
+
+	map->jit_addr = jit_addr;
+
+	if (jit_addr)
+		jit_index_add(i);
+
+	mutex_unlock(&codemap_lock);
+}
+
 static void add_code_map(code_map_t *map)
 {
 	int i;
@@ -106,15 +459,20 @@ static void add_code_map(code_map_t *map)
 		else
 			break;
 
+	jit_index_shift(i, 1);
 	codemaps[i] = *map;
 
 	n_codemaps++;
+
+	if (map->jit_addr)
+		jit_index_add(i);
 }
 
 void add_code_region(char *addr, unsigned long len, unsigned long long inode,
                                                     unsigned long long dev,
                                                     unsigned long mtime,
-                                                    unsigned long pgoffset)
+                                                    unsigned long pgoffset,
+                                                    int writable)
 {
 	del_code_region(addr, len);
 
@@ -128,16 +486,23 @@ void add_code_region(char *addr, unsigned long len, unsigned long long inode,
 		.inode = inode,
 		.mtime = mtime,
 		.pgoffset = pgoffset,
+		.hash = 0,
+		.saved_len = 0,
+		.n_holes = 0,
+		.nocache = writable,
+		.writable = writable,
 	};
 
 	mutex_lock(&codemap_lock);
-	add_code_map(&map);
+	reclaim_jit_code();
+	if (refill_hole(addr, len, inode, dev, mtime, pgoffset, writable) < 0)
+		add_code_map(&map);
 	mutex_unlock(&codemap_lock);
 }
 
 void del_code_region(char *addr, unsigned long len)
 {
-	mutex_lock(&jit_lock);     /* since we might throw away code */
+	lock_jit();     /* since we might throw away code */
 	mutex_lock(&codemap_lock);
 	int i = n_codemaps-1;
 
@@ -149,35 +514,177 @@ void del_code_region(char *addr, unsigned long len)
 			continue;
 		}
 
-		code_map_t map = codemaps[i];
-		del_code_map(i);
+		/* keep the jit code for the rest of the map if we can */
+		if (punch_hole(&codemaps[i], addr, len) == 0)
+		{
+			i--;
+			continue;
+		}
+
+		split_code_map(i, addr, len);
+		i = n_codemaps-1;
+	}
+	mutex_unlock(&codemap_lock);
+	unlock_jit();
+}
+
+/* Writes out jit code which has not made it to the jit cache yet,
+ * called before the process exits or execs.
+ */
+void save_code_maps(void)
+{
+	unsigned int i;
+
+	lock_jit();
+	mutex_lock(&codemap_lock);
 
-		map.jit_addr = NULL;
-		map.jit_len = 0;
+	for (i=0; i<n_codemaps; i++)
+		jit_cache_flush(&codemaps[i]);
 
-		unsigned long start = (unsigned long)addr,
-		              end = start + len,
-		              o_start = (unsigned long)map.addr,
-		              o_end = o_start + map.len;
+	mutex_unlock(&codemap_lock);
+	unlock_jit();
+}
 
-		if ( start > o_start )
+/* Unlinks the jit code of all maps, after writing it to the jit cache.
+ * The memory itself may still be in use by other threads, the caller
+ * frees it once they are quiescent. Called with jit_lock held, returns
+ * the amount of jit code thrown away.
+ */
+unsigned long flush_code_maps(void)
+{
+	unsigned int i;
+	unsigned long len = 0;
+
+	mutex_lock(&codemap_lock);
+
+	for (i=0; i<n_codemaps; i++)
+		if (codemaps[i].jit_addr)
 		{
-			map.addr = (char *)o_start;
-			map.len = start-o_start;
-			add_code_map(&map);
+			jit_cache_flush(&codemaps[i]);
+			len += codemaps[i].jit_len;
+
+			/* lookups without jit_lock read jit_addr first */
+			codemaps[i].jit_len = 0;
+			commit();
+			codemaps[i].jit_addr = NULL;
+			codemaps[i].saved_len = 0;
 		}
 
-		if ( o_end > end )
+	/* all jit memory gets reset */
+	n_deferred = 0;
+	n_jit_index = 0;
+
+	mutex_unlock(&codemap_lock);
+
+	return len;
+}
+
+/* Set once jit_write_protect() has write-protected a page of writable code,
+ * from then on int80_emu passes all syscalls to syscall_emu()
+ */
+long code_write_protected = 0;
+
+/* Makes the writable code in [addr, addr+len) writable again and throws
+ * away its translations, for writes code_write_fault() does not get to
+ * see: the kernel's, and our own while all signals are blocked. Returns
+ * the number of pages made writable.
+ */
+int unprotect_code_range(char *addr, unsigned long len)
+{
+	unsigned long start = PAGE_BASE(addr), end = PAGE_NEXT(&addr[len]), p, p_end, run;
+	int held, flush = 0, n = 0;
+	unsigned int i;
+
+	if ( !code_write_protected || (len == 0) )
+		return 0;
+
+	/* a signal handler which interrupted minemu while it translated */
+	held = jit_lock_held();
+	if (!held)
+		lock_jit();
+
+	mutex_lock(&codemap_lock);
+
+	for (i=0; i<n_codemaps; i++)
+	{
+		code_map_t *map = &codemaps[i];
+
+		if ( !map->writable || !map->jit_addr ||
+		     !overlap((char *)start, end-start, map->addr, map->len) )
+			continue;
+
+		p = start > (unsigned long)map->addr ? start : (unsigned long)map->addr;
+		p_end = (unsigned long)&map->addr[map->len];
+		if (p_end > end)
+			p_end = end;
+
+		/* runs of pages outside of the map's holes */
+		for (run=p; p<=p_end; p+=PG_SIZE)
 		{
-			map.addr = (char *)end;
-			map.len = o_end-end;
-			map.pgoffset += (end-o_start)/4096;
-			add_code_map(&map);
+			if ( (p < p_end) && code_map_contains(map, (char *)p) )
+				continue;
+
+			if (p > run)
+			{
+				sys_mprotect((char *)run, p-run, PROT_READ|PROT_WRITE);
+				n += (p-run)/PG_SIZE;
+
+				if (held)
+					for (; run<p; run+=PG_SIZE)
+						jit_defer_invalidate((char *)run);
+				else if (jit_invalidate_range(map, (char *)run, p-run) < 0)
+					flush = 1;
+			}
+
+			run = p+PG_SIZE;
 		}
-
-		i = n_codemaps-1;
 	}
+
 	mutex_unlock(&codemap_lock);
-	mutex_unlock(&jit_lock);
+
+	if (!held)
+	{
+		if (flush)
+			jit_flush();
+
+		unlock_jit();
+	}
+
+	return n;
 }
 
+/* Called on a write fault at addr, returns 1 if it hit a page of writable
+ * code which we write-protected, after making it writable again.
+ */
+int unprotect_code_page(char *addr)
+{
+	code_map_t *map = find_code_map(addr);
+
+	if ( (map == NULL) || !map->writable )
+		return 0;
+
+	sys_mprotect((char *)PAGE_BASE(addr), PG_SIZE, PROT_READ|PROT_WRITE);
+	return 1;
+}
+
+/* Throws away the translations of the code in the page at addr, which is
+ * being written to. Called with jit_lock held, returns -1 if this failed
+ * and all jit code has to be flushed instead.
+ */
+int invalidate_code_page(char *addr)
+{
+	int ret = 0;
+	char *page = (char *)PAGE_BASE(addr);
+	code_map_t *map;
+
+	mutex_lock(&codemap_lock);
+
+	map = find_code_map_unlocked(page);
+
+	if ( map && map->writable && map->jit_addr )
+		ret = jit_invalidate_range(map, page, PG_SIZE);
+
+	mutex_unlock(&codemap_lock);
+
+	return ret;
+}
@@ -19,6 +19,15 @@
 #ifndef CODEMAP_H
 #define CODEMAP_H
 
+#define MAX_CODEMAP_HOLES (4)
+
+typedef struct
+{
+	char *addr;
+	unsigned long len;
+
+} code_range_t;
+
 typedef struct
 {
     char *addr; 
@@ -30,16 +39,60 @@ typedef struct
 	unsigned long long inode, dev;
 	unsigned long mtime, pgoffset;
 
+	/* hash of the original code and the hooks applied to it,
+	 * used as the jit cache key, 0 if not yet computed
+	 */
+	unsigned long long hash;
+
+	/* jit_len when the jit code was last written to or read from
+	 * the jit cache
+	 */
+	unsigned long saved_len;
+
+	/* jit_len when the chunks were last added to the reverse lookup
+	 * index, see jit_index_chunks()
+	 */
+	unsigned long indexed_len;
+
+	/* sub-ranges which are no longer executable, sorted by address.
+	 * Jit code for these has been invalidated, the rest of the map's
+	 * code remains valid.
+	 */
+	unsigned long n_holes;
+	code_range_t holes[MAX_CODEMAP_HOLES];
+
+	/* the code may differ from what was hashed, do not use the jit cache */
+	int nocache;
+
+	/* the program may write to this code, pages with translated code
+	 * are write-protected, see code_write_fault()
+	 */
+	int writable;
+
 } code_map_t;
 
 code_map_t *find_code_map(char *addr);
+int code_map_contains(code_map_t *map, char *addr);
+void code_map_segment(code_map_t *map, char *addr, char **seg, unsigned long *seg_len);
 code_map_t *find_jit_code_map(char *jit_addr);
+void code_map_set_jit(code_map_t *map, char *jit_addr);
 
 void add_code_region(char *addr, unsigned long len, unsigned long long inode,
                                                     unsigned long long dev,
                                                     unsigned long mtime,
-                                                    unsigned long pgoffset);
+                                                    unsigned long pgoffset,
+                                                    int writable);
 
 void del_code_region(char *addr, unsigned long len);
 
+void save_code_maps(void);
+unsigned long flush_code_maps(void);
+
+extern long code_write_protected;
+
+int unprotect_code_page(char *addr);
+int unprotect_code_range(char *addr, unsigned long len);
+int invalidate_code_page(char *addr);
+int defer_jit_free(char *addr, unsigned long len, char *jit_addr);
+
 #endif /* CODEMAP_H */
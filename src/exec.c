@@ -26,6 +26,7 @@
 #include "load_script.h"
 #include "options.h"
 #include "threads.h"
+#include "codemap.h"
 
 int can_load_binary(elf_prog_t *prog)
 {
@@ -69,6 +70,8 @@ long user_execve(char *filename, char *argv[], char *envp[])
 	 * would generate after the point of no return.
 	 */
 
+	save_code_maps();
+
 	mutex_lock(&argv_lock); /* get exclusive access to the argv buffer */
 	exec_argv[0] = argv[0];
 	char maskbuf[17];
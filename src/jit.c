@@ -37,10 +37,79 @@
 #include "jit_cache.h"
 #include "threads.h"
 #include "hooks.h"
+#include "pretranslate.h"
+#include "stats.h"
 
 long jit_lock = 0;
 
-#define TRANSLATED_MAX_SIZE (255)
+/* The thread holding jit_lock may itself fault on a write-protected code
+ * page (copying guest data while translating, for instance.) It cannot
+ * wait for the lock it holds, and invalidating code under the feet of
+ * the interrupted jit code is no option either, so the page is queued
+ * and invalidated when the lock is released.
+ */
+#define JIT_PENDING_MAX (8)
+static thread_ctx_t *jit_lock_owner = NULL;
+static char *jit_pending[JIT_PENDING_MAX];
+static long jit_pending_overflow = 0;
+
+void lock_jit(void)
+{
+	mutex_lock(&jit_lock);
+	jit_lock_owner = get_thread_ctx();
+}
+
+int trylock_jit(void)
+{
+	if (!mutex_trylock(&jit_lock))
+		return 0;
+
+	jit_lock_owner = get_thread_ctx();
+	return 1;
+}
+
+int jit_lock_held(void)
+{
+	return jit_lock_owner == get_thread_ctx();
+}
+
+/* called from the signal handler of the lock owner */
+void jit_defer_invalidate(char *addr)
+{
+	long i;
+
+	for (i=0; i<JIT_PENDING_MAX; i++)
+		if (__sync_bool_compare_and_swap(&jit_pending[i], NULL, (char *)PAGE_BASE(addr)))
+			return;
+
+	jit_pending_overflow = 1;
+}
+
+void unlock_jit(void)
+{
+	long i, flush = 0;
+	char *page;
+
+	for (i=0; i<JIT_PENDING_MAX; i++)
+		if ( (page = __sync_lock_test_and_set(&jit_pending[i], NULL)) &&
+		     (invalidate_code_page(page) < 0) )
+			flush = 1;
+
+	if ( flush || __sync_lock_test_and_set(&jit_pending_overflow, 0) )
+		jit_flush();
+
+	jit_lock_owner = NULL;
+	mutex_unlock(&jit_lock);
+}
+
+#define JIT_MIN_RESERVE (0x10000)
+
+/* the jit code has been unlinked by a jit_flush() which could not reset
+ * the jit memory yet, cleared when new jit memory is handed out
+ */
+static int jit_flush_pending = 0;
+
+#define JIT_FLUSH_TRIES (10)
 
 unsigned long min(unsigned long a, unsigned long b) { return a<b ? a:b; }
 
@@ -51,7 +120,9 @@ unsigned long min(unsigned long a, unsigned long b) { return a<b ? a:b; }
  *
  * offset
  * -----------------------
- * 0x00                Chunk header
+ * 0x00                Chunk header, the code was translated as part of
+ *                     the segment hdr.seg, jumps out of it go through
+ *                     the runtime.
  *
  * sizeof(jit_chunk_t) JIT code
  *
@@ -91,10 +162,14 @@ typedef struct
 {
 	char *addr; unsigned long len;
 	unsigned long chunk_len, lookup_off, tbl_off, n_ops;
-	int tree_depth;
+	char *seg; unsigned long seg_len;
+	int flags;
 
 } jit_chunk_t;
 
+#define CHUNK_DEAD        (1) /* invalidated, skipped by lookups */
+#define CHUNK_FALLTHROUGH (2) /* ends with a jump to addr+len */
+
 
 /* a */
 typedef struct
@@ -226,8 +301,9 @@ typedef struct
 #define CHUNK_OFFSET(x) ( (long)(x) - (long)(hdr) )
 #define DIV_CEIL(x, d) ( ( (long)(x)+(long)(d)-1)/(long)(d) )
 
-static void jit_chunk_create_lookup_mapping(jit_chunk_t *hdr, size_pair_t *sizes,
-                                            char *base, unsigned long max_len)
+/* returns -1 if we run out of jit memory */
+static int jit_chunk_create_lookup_mapping(jit_chunk_t *hdr, size_pair_t *sizes,
+                                           char *base, unsigned long max_len)
 {
 	long n_frames = DIV_CEIL(hdr->len, FRAME_SIZE);
 
@@ -256,7 +332,7 @@ static void jit_chunk_create_lookup_mapping(jit_chunk_t *hdr, size_pair_t *sizes
 		}
 
 		if ((unsigned long)&table[j+1] > (unsigned long)&base[max_len])
-			die("out of JIT memory");
+			return -1;
 
 		table[j] = sizes[i];
 		s_off   += sizes[i].orig;
@@ -264,13 +340,14 @@ static void jit_chunk_create_lookup_mapping(jit_chunk_t *hdr, size_pair_t *sizes
 	}
 
 	hdr->chunk_len = CHUNK_OFFSET(ALIGN(&table[j], 64));
+	return 0;
 }
 
 #undef ALIGN
 
 static char *jit_chunk_lookup_addr(jit_chunk_t *hdr, char *addr)
 {
-	if (!contains(hdr->addr, hdr->len, addr))
+	if ( (hdr->flags & CHUNK_DEAD) || !contains(hdr->addr, hdr->len, addr) )
 		return NULL;
 
 	/* Stage 1 lookup */
@@ -311,15 +388,16 @@ static char *jit_chunk_lookup_addr(jit_chunk_t *hdr, char *addr)
 static char *jit_map_lookup_addr(code_map_t *map, char *addr)
 {
 	unsigned long off = 0;
-	char *jit_addr;
+	char *jit_addr, *base = map->jit_addr;
 
-	if (map->jit_addr == NULL)
+	/* read before jit_len, see flush_code_maps() */
+	if (base == NULL)
 		return NULL;
 
 	/* go through all chunks until we find a mapping */
 	while (off < map->jit_len)
 	{
-		jit_chunk_t *hdr = (jit_chunk_t *)&map->jit_addr[off];
+		jit_chunk_t *hdr = (jit_chunk_t *)&base[off];
 
 		if ( (jit_addr = jit_chunk_lookup_addr(hdr, addr)) )
 			return jit_addr;
@@ -332,11 +410,19 @@ static char *jit_map_lookup_addr(code_map_t *map, char *addr)
 
 char *jit_lookup_addr(char *addr)
 {
-	code_map_t *map = find_code_map(addr);
-	char *jit_addr = NULL;
+	char *jit_addr = find_shared_mapping(addr);
 
-	if (map)
-		jit_addr = jit_map_lookup_addr(map, addr);
+	if (jit_addr == NULL)
+	{
+		unsigned long gen = shared_cache_gen();
+		code_map_t *map = find_code_map(addr);
+
+		if (map)
+			jit_addr = jit_map_lookup_addr(map, addr);
+
+		if (jit_addr)
+			add_shared_mapping(addr, jit_addr, gen);
+	}
 
 	if (jit_addr)
 		add_jmp_mapping(addr, jit_addr);
@@ -403,9 +489,55 @@ static char *jit_chunk_rev_lookup_addr(jit_chunk_t *hdr, char *jit_addr, char **
 	return &hdr->addr[s_off];
 }
 
+/* Offset of the chunk which covers the start of each jit page, relative to
+ * the jit_addr of the map that owns the page. Entries are written before
+ * jit_len grows past them, so readers need no lock.
+ */
+static unsigned long jit_page_chunk[JIT_PAGES];
+
+static void jit_index_chunks(code_map_t *map, unsigned long end)
+{
+	unsigned long off = map->indexed_len, page;
+	jit_chunk_t *hdr;
+
+	/* the jit code has been thrown away or moved since */
+	if (off != map->jit_len)
+		off = 0;
+
+	for (; off<end; off+=hdr->chunk_len)
+	{
+		hdr = (jit_chunk_t *)&map->jit_addr[off];
+
+		for (page = PAGE_NEXT(&map->jit_addr[off]);
+		     page < (unsigned long)&map->jit_addr[off+hdr->chunk_len];
+		     page += PG_SIZE)
+			jit_page_chunk[(page-JIT_START)/PG_SIZE] = off;
+	}
+
+	map->indexed_len = end;
+}
+
+/* offset of a chunk at or before jit_addr */
+static unsigned long jit_index_lookup(code_map_t *map, char *jit_addr)
+{
+	unsigned long page = PAGE_BASE(jit_addr), off;
+
+	if ( (page < (unsigned long)map->jit_addr) ||
+	     !contains(map->jit_addr, map->jit_len, jit_addr) ||
+	     (page-JIT_START >= JIT_SIZE) )
+		return 0;
+
+	off = jit_page_chunk[(page-JIT_START)/PG_SIZE];
+
+	if (off > page-(unsigned long)map->jit_addr)
+		return 0;
+
+	return off;
+}
+
 static char *jit_map_rev_lookup_addr(code_map_t *map, char *jit_addr, char **jit_op_start, long *jit_op_len)
 {
-	unsigned long off = 0;
+	unsigned long off = jit_index_lookup(map, jit_addr);
 	char *addr;
 
 	while (off < map->jit_len)
@@ -478,7 +610,8 @@ static void jit_fill_mapping(code_map_t *map, unsigned long *mapping,
 	while (off < map->jit_len)
 	{
 		jit_chunk_t *hdr = (jit_chunk_t *)&map->jit_addr[off];
-		jit_chunk_fill_mapping(map, hdr, mapping);
+		if ( !(hdr->flags & CHUNK_DEAD) )
+			jit_chunk_fill_mapping(map, hdr, mapping);
 		off += hdr->chunk_len;
 	}
 }
@@ -499,17 +632,24 @@ static int try_resolve_jmp(code_map_t *map, char *jmp_addr, char *imm_addr,
 
 /* Translate a chunk of chunk of code
  *
+ * Returns NULL if the chunk does not fit in the map's jit memory
  */
 static jit_chunk_t *jit_translate_chunk(code_map_t *map, char *entry_addr, unsigned long chunk_base,
                                         jmp_heap_t *jmp_heap, unsigned long *mapping)
 {
-	char *jit_addr=map->jit_addr, *addr=map->addr;
+	char *jit_addr=map->jit_addr, *addr=map->addr, *seg;
 	unsigned long n_ops = 0,
 	              entry = entry_addr-addr,
 	              s_off = entry_addr-addr,
 	              d_off = chunk_base+sizeof(jit_chunk_t),
-	              max_len = jit_mem_size(jit_addr);
-	int stop = 0, is_hook, hook_size=0;
+	              max_len = jit_mem_size(jit_addr),
+	              seg_len;
+	int stop = 0, is_hook, hook_size=0, flags = 0,
+	    is_vdso = contains(addr, map->len, (char *)vdso);
+	vdso_func_t vdso_func = NULL;
+
+	code_map_segment(map, entry_addr, &seg, &seg_len);
+	unsigned long seg_end = seg+seg_len-addr;
 
 	instr_t instr;
 	trans_t trans;
@@ -519,7 +659,7 @@ static jit_chunk_t *jit_translate_chunk(code_map_t *map, char *entry_addr, unsig
 	while (stop == 0)
 	{
 		if ( d_off+TRANSLATED_MAX_SIZE > max_len )
-			die("out of JIT memory");
+			return NULL;
 
 		is_hook = (mapping[s_off] == HOOK);
 
@@ -529,8 +669,25 @@ static jit_chunk_t *jit_translate_chunk(code_map_t *map, char *entry_addr, unsig
 			d_off += hook_size = generate_hook(&jit_addr[d_off], &addr[s_off],
 			                                   get_hook_func(map, s_off));
 
-		stop = read_op(&addr[s_off], &instr, map->len-s_off);
-		translate_op(&jit_addr[d_off], &instr, &trans, map->addr, map->len);
+		stop = read_op(&addr[s_off], &instr, seg_end-s_off);
+
+		if (is_vdso)
+			vdso_func = get_vdso_func(&addr[s_off]);
+
+		if (vdso_func)
+		{
+			/* the call returns through vdso_stub */
+			generate_vdso_call(&jit_addr[d_off], vdso_func, &trans);
+			stop = 1;
+		}
+		else if ( is_vdso && sysenter_reentry && (&addr[s_off] == kernel_vsyscall) )
+		{
+			/* skip the sysenter dance, return from the pop %ebp; pop %edx; pop %ecx; ret */
+			generate_vsyscall(&jit_addr[d_off], (char *)sysenter_reentry+3, &trans, seg, seg_len);
+			stop = 1;
+		}
+		else
+			translate_op(&jit_addr[d_off], &instr, &trans, seg, seg_len);
 
 		/* try to resolve translated jumps early */
 		if ( (trans.imm != 0) && !try_resolve_jmp(map, trans.jmp_addr,
@@ -551,11 +708,16 @@ static jit_chunk_t *jit_translate_chunk(code_map_t *map, char *entry_addr, unsig
 		if (is_hook)
 			sizes[n_ops].jit += hook_size;
 
-		if ( TRANSLATED(mapping[s_off]) )
+		/* continue in translated code, or leave through the runtime
+		 * when we run into a hole in the map
+		 */
+		if ( TRANSLATED(mapping[s_off]) ||
+		     ( !stop && (s_off == seg_end) && (seg_end != map->len) ) )
 		{
 			stop = 1;
+			flags |= CHUNK_FALLTHROUGH;
 			generate_jump(&jit_addr[d_off], &addr[s_off], &trans,
-			              map->addr, map->len);
+			              seg, seg_len);
 
 			if (trans.imm != 0)
 				if (!try_resolve_jmp(map, trans.jmp_addr,
@@ -575,64 +737,571 @@ static jit_chunk_t *jit_translate_chunk(code_map_t *map, char *entry_addr, unsig
 		.len = s_off-entry,
 		.chunk_len = d_off-chunk_base, /* to be extended during lookup map creation */
 		.n_ops = n_ops,
+		.seg = seg,
+		.seg_len = seg_len,
+		.flags = flags,
 	};
 
-	jit_chunk_create_lookup_mapping(hdr, sizes, jit_addr, max_len);
+	if (jit_chunk_create_lookup_mapping(hdr, sizes, jit_addr, max_len) < 0)
+		return NULL;
 
 	return hdr;
 }
 
-void jit_resize(code_map_t *map, unsigned long cur_size)
+/* Iterates over the chunks in jit_code[0..jit_len), start with *off = 0
+ *
+ * Returns 1 if info was filled in, 0 at the end of the code and -1 if
+ * the chunk at *off is malformed.
+ */
+int jit_next_chunk(char *jit_code, unsigned long jit_len, unsigned long *off,
+                   jit_chunk_info_t *info)
 {
-	unsigned long est_size = map->len*4 + map->len/2;
-	if (est_size < cur_size)
-		est_size = cur_size;
+	if (*off == jit_len)
+		return 0;
+
+	if ( (*off & 63) || (*off+sizeof(jit_chunk_t) > jit_len) )
+		return -1;
+
+	jit_chunk_t *hdr = (jit_chunk_t *)&jit_code[*off];
 
-	jit_mem_try_resize(map->jit_addr, est_size);
+	if ( (hdr->chunk_len < sizeof(jit_chunk_t)) ||
+	     (hdr->chunk_len > jit_len - *off) )
+		return -1;
+
+	*info = (jit_chunk_info_t)
+	{
+		.jit_off = *off,
+		.jit_len = hdr->chunk_len,
+		.addr = hdr->addr,
+		.len = hdr->len,
+	};
+
+	*off += hdr->chunk_len;
+	return 1;
+}
+
+/* Fills len bytes at dest with an empty chunk, which is skipped by all
+ * lookups. Used to let the jit code of a map end on a page boundary.
+ */
+void jit_padding_chunk(char *dest, unsigned long len)
+{
+	memset(dest, 0, len);
+
+	*(jit_chunk_t*)dest = (jit_chunk_t)
+	{
+		.addr = NULL,
+		.len = 0,
+		.chunk_len = len,
+		.lookup_off = 0, /* reverse lookups never match */
+		.n_ops = 0,
+	};
+}
+
+/* Measured expansion of original code into jit code, in sixteenths.
+ * Starts out at 4.5, the first few maps do not swing it much.
+ */
+static unsigned long orig_bytes = 0x1000, jit_bytes = 0x4800;
+
+#define EXPANSION_16 ( jit_bytes*16/orig_bytes )
+
+static void jit_measure(code_map_t *map, unsigned long off, unsigned long end)
+{
+	jit_chunk_t *hdr;
+
+	for (; off<end; off+=hdr->chunk_len)
+	{
+		hdr = (jit_chunk_t *)&map->jit_addr[off];
+		orig_bytes += hdr->len;
+		jit_bytes += hdr->chunk_len;
+	}
+
+	while (jit_bytes > 0x8000000)
+	{
+		orig_bytes /= 2;
+		jit_bytes /= 2;
+	}
+}
+
+/* Reserves room for the translation of the whole map at the measured
+ * expansion rate. Maps which outgrow their reservation are relocated.
+ */
+static unsigned long jit_reserve_size(code_map_t *map, unsigned long cur_size)
+{
+	unsigned long est_size = (map->len/16)*EXPANSION_16 + JIT_MIN_RESERVE;
+	return est_size < cur_size ? cur_size : est_size;
+}
+
+void jit_resize(code_map_t *map, unsigned long cur_size)
+{
+	jit_mem_try_resize(map->jit_addr, jit_reserve_size(map, cur_size));
+	jit_index_chunks(map, cur_size);
 
 	commit();
 	map->jit_len = cur_size;
 	commit();
 }
 
-/* Translates all reachable code from map starting from entry_addr
- *
+/* The program may write to this code, make sure we notice by
+ * write-protecting the pages of the chunks in [off, end)
  */
-static void jit_translate(code_map_t *map, char *entry_addr)
+static void jit_write_protect(code_map_t *map, unsigned long off, unsigned long end)
+{
+	unsigned long start = 0, stop = 0, c_start, c_stop;
+	jit_chunk_t *hdr;
+
+	for (; off<end; off+=hdr->chunk_len)
+	{
+		hdr = (jit_chunk_t *)&map->jit_addr[off];
+
+		if (hdr->len == 0)
+			continue;
+
+		c_start = PAGE_BASE(hdr->addr);
+		c_stop = PAGE_NEXT(&hdr->addr[hdr->len]);
+
+		if ( (c_start >= start) && (c_stop <= stop) )
+			continue;
+
+		code_write_protected = 1;
+		sys_mprotect((char *)c_start, c_stop-c_start, PROT_READ);
+		start = c_start;
+		stop = c_stop;
+	}
+}
+
+/* Translates all reachable code from map starting from each of the
+ * n_entries addresses in entries into the free space after the map's
+ * jit code, returns the new end of the jit code or -1 if it does not fit.
+ */
+static long jit_translate_all(code_map_t *map, char **entries, unsigned long n_entries,
+                              rel_jmp_t *jumps, unsigned long *mapping)
 {
 	jmp_heap_t jmp_heap;
 	rel_jmp_t j;
-	rel_jmp_t jumps[map->len/4]; /* mostly unused */
-	unsigned long mapping[map->len+1]; /* waste of memory :-( */
-	unsigned long chunk_base = map->jit_len;
+	unsigned long chunk_base = map->jit_len, i;
 	jit_chunk_t *hdr;
 
 	heap_init(&jmp_heap, jumps, map->len/4);
 
 	jit_fill_mapping(map, mapping, map->len+1);
 
+	for (i=0; i<n_entries; i++)
+	{
+		if ( !code_map_contains(map, entries[i]) ||
+		     TRANSLATED(mapping[entries[i]-map->addr]) )
+			continue;
+
+		if ( !(hdr = jit_translate_chunk(map, entries[i], chunk_base, &jmp_heap, mapping)) )
+			return -1;
+
+		chunk_base += hdr->chunk_len;
+
+		while (heap_get(&jmp_heap, &j))
+			while (!try_resolve_jmp(map, j.addr, &map->jit_addr[j.off], mapping))
+			{
+				if ( !(hdr = jit_translate_chunk(map, j.addr, chunk_base, &jmp_heap, mapping)) )
+					return -1;
+
+				chunk_base += hdr->chunk_len;
+			}
+	}
+
+	return chunk_base;
+}
+
+/* Translates all reachable code from map starting from each of the
+ * n_entries addresses in entries, addresses outside of map or which have
+ * already been translated are skipped.
+ *
+ * Returns -1 if the map runs out of jit memory, nothing is added then.
+ */
+int jit_translate_entries(code_map_t *map, char **entries, unsigned long n_entries)
+{
+	rel_jmp_t jumps[map->len/4]; /* mostly unused */
+	unsigned long mapping[map->len+1]; /* waste of memory :-( */
+	unsigned long size = jit_mem_size(map->jit_addr), new_size;
+	long end;
+
 	unsigned long base_off = PAGE_BASE(map->jit_len);
 	char *base = &map->jit_addr[base_off];
 
+	sys_mprotect(base, size-base_off, PROT_READ|PROT_WRITE|PROT_EXEC);
+
+	/* new chunks are only referenced by other new chunks, so a failed
+	 * attempt can simply be started over. Only claim the free space
+	 * after our block when the reserved space turns out to be too small.
+	 */
+	while ( (end = jit_translate_all(map, entries, n_entries, jumps, mapping)) < 0 )
+	{
+		new_size = jit_mem_size(jit_mem_balloon(map->jit_addr));
+
+		if (new_size == size)
+			break;
+
+		sys_mprotect(&map->jit_addr[size], new_size-size,
+		             PROT_READ|PROT_WRITE|PROT_EXEC);
+		size = new_size;
+	}
+
+	if (end < 0)
+	{
+		jit_resize(map, map->jit_len);
+
+		sys_mprotect(base, jit_mem_size(map->jit_addr)-base_off,
+		                   PROT_READ|PROT_EXEC);
+		return -1;
+	}
+
+	if (map->writable)
+		jit_write_protect(map, map->jit_len, end);
+
+	jit_measure(map, map->jit_len, end);
+	jit_resize(map, end);
+
 	sys_mprotect(base, jit_mem_size(map->jit_addr)-base_off,
-	             PROT_READ|PROT_WRITE|PROT_EXEC);
+	                   PROT_READ|PROT_EXEC);
+	return 0;
+}
+
+/* invalidation */
+
+static jit_chunk_t *jit_map_chunk_at(code_map_t *map, char *jit_addr)
+{
+	unsigned long off = jit_index_lookup(map, jit_addr);
+	jit_chunk_t *hdr;
+
+	while (off < map->jit_len)
+	{
+		hdr = (jit_chunk_t *)&map->jit_addr[off];
+
+		if (contains((char *)hdr, hdr->chunk_len, jit_addr))
+			return hdr;
+
+		off += hdr->chunk_len;
+	}
+
+	return NULL;
+}
+
+/* Redirects a translated jump to an exit stub if it goes into a dead
+ * chunk, only jumps to [lo, hi) in the original code are considered.
+ */
+static int jit_unlink_jmp(code_map_t *map, trans_t *trans, char *imm_addr,
+                          char *lo, char *hi, unsigned long *stub_off,
+                          unsigned long max_len)
+{
+	if ( (trans->imm == 0) ||
+	     ((unsigned long)trans->jmp_addr <  (unsigned long)lo) ||
+	     ((unsigned long)trans->jmp_addr >= (unsigned long)hi) )
+		return 0;
+
+	jit_chunk_t *dest = jit_map_chunk_at(map, imm_addr+4+imm_at(imm_addr, 4));
+
+	if ( (dest == NULL) || !(dest->flags & CHUNK_DEAD) )
+		return 0;
+
+	if ( *stub_off+TRANSLATED_MAX_SIZE > max_len )
+		return -1;
+
+	*stub_off += generate_stub(&map->jit_addr[*stub_off], trans->jmp_addr, imm_addr);
+	return 0;
+}
+
+/* The jumps in a chunk are found by translating its instructions again
+ * into a scratch buffer, with the same segment bounds.
+ */
+static int jit_chunk_unlink(code_map_t *map, jit_chunk_t *hdr, char *lo, char *hi,
+                            unsigned long *stub_off, unsigned long max_len)
+{
+	char buf[TRANSLATED_MAX_SIZE], *code = (char *)&hdr[1];
+	char *seg_end = &hdr->seg[hdr->seg_len];
+	size_pair_t *sizes = (size_pair_t *)&((char *)hdr)[hdr->tbl_off];
+	unsigned long i, j, s_off = 0;
+	instr_t instr;
+	trans_t trans;
+
+	for (i=0,j=0; i<hdr->n_ops; i++,j++)
+	{
+		if ( sizes[j].orig == 0 )
+			j++;
+
+		read_op(&hdr->addr[s_off], &instr, seg_end-&hdr->addr[s_off]);
+		translate_op(buf, &instr, &trans, hdr->seg, hdr->seg_len);
+		s_off += sizes[j].orig;
+		code += sizes[j].jit;
+
+		/* the translated instruction comes after its hook, if any */
+		if (jit_unlink_jmp(map, &trans, code-trans.len+trans.imm,
+		                   lo, hi, stub_off, max_len) < 0)
+			return -1;
+	}
+
+	if (hdr->flags & CHUNK_FALLTHROUGH)
+	{
+		generate_jump(buf, &hdr->addr[hdr->len], &trans, hdr->seg, hdr->seg_len);
+
+		if (jit_unlink_jmp(map, &trans, code+trans.imm,
+		                   lo, hi, stub_off, max_len) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Invalidates the jit code for [addr, addr+len) of map, the code for the
+ * rest of the map stays in place. Chunks overlapping the range are marked
+ * dead, and direct jumps into them from live chunks are redirected to
+ * exit stubs, which are added as a new chunk. Threads which are inside
+ * a dead chunk at this moment will finish the old code until they jump
+ * out of it. Called with jit_lock held.
+ *
+ * Returns -1 if there is no room for the stubs, the caller should then
+ * throw away all of the map's jit code.
+ */
+int jit_invalidate_range(code_map_t *map, char *addr, unsigned long len)
+{
+	unsigned long off, n_dead = 0, max_len,
+	              stub_base = map->jit_len,
+	              stub_off = stub_base+sizeof(jit_chunk_t);
+	char *lo = (char *)ULONG_MAX, *hi = NULL;
+	jit_chunk_t *hdr;
+	int ret = 0;
+
+	for (off=0; off<map->jit_len; off+=hdr->chunk_len)
+	{
+		hdr = (jit_chunk_t *)&map->jit_addr[off];
+
+		if ( !(hdr->flags & CHUNK_DEAD) && overlap(hdr->addr, hdr->len, addr, len) )
+			n_dead++;
+	}
+
+	if (n_dead == 0)
+		return 0;
+
+	/* cache-backed code is a private mapping (see try_load_jit_cache()),
+	 * if we still cannot write it, the map's code has to go as a whole
+	 */
+	if (sys_mprotect(map->jit_addr, jit_mem_size(map->jit_addr),
+	                 PROT_READ|PROT_WRITE|PROT_EXEC) < 0)
+		return -1;
 
 	jit_mem_balloon(map->jit_addr);
+	max_len = jit_mem_size(map->jit_addr);
 
-	hdr = jit_translate_chunk(map, entry_addr, chunk_base, &jmp_heap, mapping);
-	chunk_base += hdr->chunk_len;
+	for (off=0; off<map->jit_len; off+=hdr->chunk_len)
+	{
+		hdr = (jit_chunk_t *)&map->jit_addr[off];
 
-	while (heap_get(&jmp_heap, &j))
-		while (!try_resolve_jmp(map, j.addr, &map->jit_addr[j.off], mapping))
+		if ( !(hdr->flags & CHUNK_DEAD) && overlap(hdr->addr, hdr->len, addr, len) )
 		{
-			hdr = jit_translate_chunk(map, j.addr, chunk_base, &jmp_heap, mapping);
-			chunk_base += hdr->chunk_len;
+			hdr->flags |= CHUNK_DEAD;
+
+			if ( (unsigned long)hdr->addr < (unsigned long)lo )
+				lo = hdr->addr;
+			if ( (unsigned long)&hdr->addr[hdr->len] > (unsigned long)hi )
+				hi = &hdr->addr[hdr->len];
 		}
+	}
 
-	jit_resize(map, chunk_base);
+	commit();
 
-	sys_mprotect(base, jit_mem_size(map->jit_addr)-base_off,
-	                   PROT_READ|PROT_EXEC);
+	for (off=0; off<map->jit_len; off+=hdr->chunk_len)
+	{
+		hdr = (jit_chunk_t *)&map->jit_addr[off];
+
+		if ( !(hdr->flags & CHUNK_DEAD) &&
+		     (jit_chunk_unlink(map, hdr, lo, hi, &stub_off, max_len) < 0) )
+		{
+			ret = -1;
+			break;
+		}
+	}
+
+	if (stub_off > stub_base+sizeof(jit_chunk_t))
+	{
+		/* like a padding chunk, lookups skip it */
+		hdr = (jit_chunk_t *)&map->jit_addr[stub_base];
+		*hdr = (jit_chunk_t)
+		{
+			.addr = NULL,
+			.len = 0,
+			.chunk_len = (stub_off-stub_base+63) & ~63UL,
+			.lookup_off = 0,
+			.n_ops = 0,
+		};
+		jit_resize(map, stub_base+hdr->chunk_len);
+	}
+	else
+		jit_resize(map, map->jit_len);
+
+	sys_mprotect(map->jit_addr, jit_mem_size(map->jit_addr),
+	             PROT_READ|PROT_EXEC);
+
+	purge_caches(lo, hi-lo);
+	stats.jit_chunks_invalidated += n_dead;
+
+	return ret;
+}
+
+/* Allocates jit memory for map and fills it from the cache if possible.
+ * Jit code depends on its address, and allocations are handed out in
+ * order, so every process should allocate maps in the same order for
+ * cache files to be usable.
+ */
+int jit_map_alloc(code_map_t *map)
+{
+	unsigned long size = jit_reserve_size(map, 0),
+	              largest, unused = jit_mem_unused(&largest);
+
+	/* plenty of jit memory left, but only in pieces too small to hold
+	 * the map: compact by starting over
+	 */
+	if ( (largest < size) && (unused/4 > largest) )
+	{
+		stats.jit_compactions++;
+		jit_flush();
+		jit_mem_unused(&largest);
+	}
+
+	char *jit_addr = jit_mem_alloc(min(size, largest));
+
+	if (jit_addr == NULL)
+		return -1;
+
+	jit_flush_pending = 0;
+	code_map_set_jit(map, jit_addr);
+	try_load_jit_cache(map);
+
+	/* do not hold on to the whole region */
+	jit_resize(map, map->jit_len);
+	return 0;
+}
+
+/* The map's jit code outgrew its block: move it to a larger block by
+ * translating its live chunks again at the new address, which takes care
+ * of all absolute addresses in the code and leaves out dead chunks.
+ * The old block is freed once no thread can be running from it.
+ *
+ * Returns -1 if there is no larger block.
+ */
+static int jit_map_relocate(code_map_t *map)
+{
+	unsigned long off, n = 0, live = 0;
+	jit_chunk_t *hdr;
+
+	if (map->jit_addr == NULL)
+		return -1;
+
+	for (off=0; off<map->jit_len; off+=hdr->chunk_len)
+	{
+		hdr = (jit_chunk_t *)&map->jit_addr[off];
+		if ( (hdr->len != 0) && !(hdr->flags & CHUNK_DEAD) )
+		{
+			n++;
+			live += hdr->chunk_len;
+		}
+	}
+
+	char *entries[n+1];
+
+	for (n=0, off=0; off<map->jit_len; off+=hdr->chunk_len)
+	{
+		hdr = (jit_chunk_t *)&map->jit_addr[off];
+		if ( (hdr->len != 0) && !(hdr->flags & CHUNK_DEAD) )
+			entries[n++] = hdr->addr;
+	}
+
+	code_map_t new = *map;
+	new.jit_len = 0;
+
+	new.jit_addr = jit_mem_alloc(jit_reserve_size(map, live*2 + JIT_MIN_RESERVE));
+
+	if (new.jit_addr == NULL)
+		return -1;
+
+	jit_flush_pending = 0;
+
+	if (jit_translate_entries(&new, entries, n) < 0)
+	{
+		jit_mem_free(new.jit_addr);
+		return -1;
+	}
+
+	/* the old code is still good for its own address */
+	jit_cache_flush(map);
+
+	char *old_addr = map->jit_addr;
+	map->jit_len = 0;
+	commit();
+	int in_use = (wait_quiescent() < 0);
+	code_map_set_jit(map, new.jit_addr);
+	commit();
+	map->jit_len = new.jit_len;
+	map->indexed_len = new.indexed_len;
+	/* relocated code can not be loaded at the map's usual address */
+	map->saved_len = new.jit_len;
+	map->nocache = 1;
+	commit();
+
+	/* some thread is stuck in the old code, free it once it has left */
+	if (!in_use)
+		jit_mem_free(old_addr);
+	else if (defer_jit_free(map->addr, map->len, old_addr) < 0)
+		stats.jit_mem_leaked++;
+
+	stats.jit_relocations++;
+	return 0;
+}
+
+/* Out of jit memory: throw away all jit code and start over, translations
+ * of code which is still in use are reloaded from the jit cache or
+ * retranslated on demand.
+ *
+ * If some thread does not leave the jit code, the memory stays in use
+ * and -1 is returned. The code is unlinked either way, so the next call
+ * only has to wait for the stragglers before it can reset the memory,
+ * unless new jit memory has been handed out in the meantime.
+ */
+int jit_flush(void)
+{
+	if (!jit_flush_pending)
+	{
+		stats.jit_flushes++;
+		stats.jit_flushed_bytes += flush_code_maps();
+	}
+
+	if (wait_quiescent() < 0)
+	{
+		jit_flush_pending = 1;
+		stats.jit_flushes_deferred++;
+		return -1;
+	}
+
+	jit_flush_pending = 0;
+	jit_mem_reset();
+	return 0;
+}
+
+/* returns NULL if we ran out of jit memory */
+static char *jit_translate_addr(code_map_t *map, char *addr)
+{
+	char *jit_addr;
+
+	if ( (map->jit_addr == NULL) && (jit_map_alloc(map) < 0) )
+		return NULL;
+
+	if ( (jit_addr = jit_lookup_addr(addr)) )
+		return jit_addr;
+
+	if (jit_translate_entries(map, &addr, 1) < 0)
+		return NULL;
+
+	jit_cache_update(map);
+
+	if ( (jit_addr = jit_lookup_addr(addr)) == NULL )
+		die("jit failed");
+
+	return jit_addr;
 }
 
 void jit_init(void)
@@ -642,6 +1311,11 @@ void jit_init(void)
 
 char *jit(char *addr)
 {
+	int tries;
+
+	if ( pretranslate && (addr == pretranslate_entry) )
+		pretranslate_all(); /* does not return */
+
 	char *jit_addr = find_jmp_mapping(addr);
 
 	if (jit_addr != NULL)
@@ -656,23 +1330,28 @@ char *jit(char *addr)
 		return NULL;
 	}
 
-	if (map->jit_addr == NULL)
-	{
-		map->jit_addr = jit_mem_balloon(NULL);
-		try_load_jit_cache(map);
-	}
+	jit_addr = jit_translate_addr(map, addr);
 
-	jit_addr = jit_lookup_addr(addr);
+	if ( (jit_addr == NULL) && (jit_map_relocate(map) == 0) )
+		jit_addr = jit_translate_addr(map, addr);
 
-	if (jit_addr == NULL)
+	/* give threads which hold on to the old jit memory some time, a
+	 * thread spinning in jit code without going through the runtime
+	 * would keep us waiting forever
+	 */
+	for (tries=0; jit_addr == NULL; tries++)
 	{
-		jit_translate(map, addr);
-		jit_addr = jit_lookup_addr(addr);
-		try_save_jit_cache(map);
-	}
+		if (tries == JIT_FLUSH_TRIES)
+			die("out of JIT memory");
 
-	if (jit_addr == NULL)
-		die("jit failed");
+		if (jit_flush() < 0)
+			continue;
+
+		jit_addr = jit_translate_addr(map, addr);
+
+		if (jit_addr == NULL)
+			die("out of JIT memory");
+	}
 
 	return jit_addr;
 }
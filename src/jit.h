@@ -24,9 +24,30 @@
 
 extern long jit_lock;
 
+void lock_jit(void);
+int trylock_jit(void);
+void unlock_jit(void);
+int jit_lock_held(void);
+void jit_defer_invalidate(char *addr);
+
+typedef struct
+{
+	unsigned long jit_off, jit_len;
+	char *addr;
+	unsigned long len;
+
+} jit_chunk_info_t;
+
 void jit_init(void);
 void jit_resize(code_map_t *map, unsigned long cur_size);
+int jit_map_alloc(code_map_t *map);
+int jit_translate_entries(code_map_t *map, char **entries, unsigned long n_entries);
+int jit_invalidate_range(code_map_t *map, char *addr, unsigned long len);
+void jit_padding_chunk(char *dest, unsigned long len);
+int jit_next_chunk(char *jit_code, unsigned long jit_len, unsigned long *off,
+                   jit_chunk_info_t *info);
 char *jit(char *addr);
+int jit_flush(void);
 char *jit_lookup_addr(char *addr);
 char *jit_rev_lookup_addr(char *jit_addr, char **jit_op_start, long *jit_op_len);
 
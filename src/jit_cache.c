@@ -32,6 +32,7 @@
 #include "jit.h"
 #include "taint.h"
 #include "kernel_compat.h"
+#include "hooks.h"
 
 static char cache_dir_buf[PATH_MAX+1] = { 0, };
 
@@ -46,27 +47,57 @@ unsigned long fd_filesize(int fd)
 	return s.st_size;
 }
 
+/* Cache entries are keyed by the contents of the code they translate
+ * rather than by the file they came from, so that copies of the same
+ * library (different inodes, containers) share one translation.
+ * The generated code is not position independent, so the guest and
+ * jit addresses remain part of the key.
+ */
+static unsigned long long get_map_hash(code_map_t *map)
+{
+	if (map->hash)
+		return map->hash;
+
+	unsigned long long h = fnv_hash(map->addr, map->len, FNV_INIT),
+	                   base = (unsigned long long)map->pgoffset*0x1000,
+	                   off;
+	int i;
+	hook_t *hook = hook_table;
+
+	for (i=0; i<n_hooks; i++, hook++)
+		if ( (hook->inode  == map->inode) &&
+		     (hook->mtime  == map->mtime) &&
+		     (hook->dev    == map->dev)   &&
+		     (hook->offset >= base)       &&
+		     (hook->offset <  base+map->len) )
+		{
+			off = hook->offset - base;
+			h = fnv_hash(&off, sizeof(off), h);
+			h = fnv_hash(&hook->func, sizeof(hook->func), h);
+		}
+
+	if (h == 0)
+		h = FNV_INIT;
+
+	return map->hash = h;
+}
+
 static char *get_cache_filename(char *buf, code_map_t *map, int pid)
 {
+	unsigned long long hash = get_map_hash(map);
+
 	buf[0] = '\x0';
 
 	strcat(buf, cache_dir);
-	strcat(buf, "/i");
-	hexcat(buf, map->inode >> 32);
-	hexcat(buf, map->inode & 0xffffffff);
-	strcat(buf, "-d");
-	hexcat(buf, map->dev >> 32);
-	hexcat(buf, map->dev & 0xffffffff);
-	strcat(buf, "-m");
-	hexcat(buf, map->mtime);
+	strcat(buf, "/c");
+	hexcat(buf, hash >> 32);
+	hexcat(buf, hash & 0xffffffff);
 	strcat(buf, "-a");
 	hexcat(buf, (unsigned long)map->addr);
 	strcat(buf, "-l");
 	hexcat(buf, (unsigned long)map->len);
 	strcat(buf, "-j");
 	hexcat(buf, (unsigned long)map->jit_addr);
-	strcat(buf, "-p");
-	hexcat(buf, map->pgoffset);
 	if ( call_strategy == LAZY_CALL )
 		strcat(buf, "L");
 	else if ( call_strategy == PREFETCH_ON_CALL )
@@ -100,40 +131,256 @@ char *get_jit_cache_dir(void)
 	return cache_dir;
 }
 
+/* identifies the minemu binary, cached code contains addresses of
+ * minemu's runtime code and may only be used by the same build.
+ */
+unsigned long long get_build_id(void)
+{
+	static unsigned long long build_id = 0;
+
+	if (build_id == 0)
+		build_id = fnv_hash(minemu_code_start, minemu_code_end-minemu_code_start,
+		                    FNV_INIT);
+
+	return build_id;
+}
+
+static void init_cache_hdr(jit_cache_hdr_t *hdr, code_map_t *map)
+{
+	*hdr = (jit_cache_hdr_t)
+	{
+		.version = JIT_CACHE_VERSION,
+		.build_id = get_build_id(),
+		.taint_flag = taint_flag,
+		.call_strategy = call_strategy,
+		.map_hash = get_map_hash(map),
+		.addr = (unsigned long)map->addr,
+		.len = map->len,
+		.jit_addr = (unsigned long)map->jit_addr,
+	};
+	memcpy(hdr->magic, JIT_CACHE_MAGIC, sizeof(hdr->magic));
+}
+
+#define INDEX_BATCH (64)
+
+/* Reads and checks the header and chunk index, returns 0 if the cache
+ * file can be used for map
+ */
+static int read_cache_hdr(int fd, jit_cache_hdr_t *hdr, code_map_t *map,
+                                  unsigned long size)
+{
+	jit_cache_hdr_t expect;
+	jit_chunk_info_t index[INDEX_BATCH];
+	unsigned long long sum, hdr_sum;
+	unsigned long i, n, off;
+
+	if ( read_at(fd, 0, hdr, sizeof(*hdr)) != sizeof(*hdr) )
+		return -1;
+
+	init_cache_hdr(&expect, map);
+	expect.hdr_size = hdr->hdr_size;
+	expect.jit_len = hdr->jit_len;
+	expect.n_chunks = hdr->n_chunks;
+	expect.code_sum = hdr->code_sum;
+	expect.hdr_sum = hdr->hdr_sum;
+
+	if ( memcmp(hdr, &expect, sizeof(expect)) != 0 )
+		return -1; /* different build, settings or code */
+
+	if ( (hdr->hdr_size & PG_MASK) || (hdr->jit_len & PG_MASK) ||
+	     (hdr->jit_len == 0) ||
+	     (hdr->hdr_size < sizeof(*hdr)+hdr->n_chunks*sizeof(jit_chunk_info_t)) ||
+	     (hdr->hdr_size+hdr->jit_len != size) )
+		return -1;
+
+	hdr_sum = hdr->hdr_sum;
+	hdr->hdr_sum = 0;
+	sum = fnv_hash(hdr, sizeof(*hdr), FNV_INIT);
+	hdr->hdr_sum = hdr_sum;
+
+	for (i=0, off=sizeof(*hdr); i<hdr->n_chunks; i+=n, off+=n*sizeof(*index))
+	{
+		n = hdr->n_chunks-i;
+		if (n > INDEX_BATCH)
+			n = INDEX_BATCH;
+
+		if ( read_at(fd, off, index, n*sizeof(*index)) != (long)(n*sizeof(*index)) )
+			return -1;
+
+		sum = fnv_hash(index, n*sizeof(*index), sum);
+	}
+
+	return (sum == hdr_sum) ? 0 : -1;
+}
+
+/* Checks the chunk headers of the mapped code against the chunk index,
+ * a corrupt chunk chain would send lookups into an endless loop. Only
+ * the chunk headers are read, the rest of the code is not touched
+ * until it runs. code_sum is checked by jit_cache_gc() on -cachegc.
+ */
+static int check_cache_chunks(int fd, jit_cache_hdr_t *hdr, char *jit_code)
+{
+	jit_chunk_info_t index[INDEX_BATCH], info;
+	unsigned long i, j, n, off, jit_off = 0;
+
+	for (i=0, off=sizeof(*hdr); i<hdr->n_chunks; i+=n, off+=n*sizeof(*index))
+	{
+		n = hdr->n_chunks-i;
+		if (n > INDEX_BATCH)
+			n = INDEX_BATCH;
+
+		if ( read_at(fd, off, index, n*sizeof(*index)) != (long)(n*sizeof(*index)) )
+			return -1;
+
+		for (j=0; j<n; j++)
+			if ( (jit_next_chunk(jit_code, hdr->jit_len, &jit_off, &info) != 1) ||
+			     (memcmp(&info, &index[j], sizeof(info)) != 0) )
+				return -1;
+	}
+
+	return jit_next_chunk(jit_code, hdr->jit_len, &jit_off, &info);
+}
+
+/* The jit code in the cache file is mapped private and read-only, clean
+ * pages are shared by every process using the same translation. The
+ * mapping is copy-on-write, so the jit code can still be patched like
+ * anonymous jit memory (invalidation stubs, relocation). The code always
+ * ends on a page boundary (see try_save_jit_cache()) so newly translated
+ * code is appended to private pages without touching the shared ones.
+ */
 int try_load_jit_cache(code_map_t *map)
 {
-	if ( (map->inode == 0) || (cache_dir == NULL) )
+	if ( (map->inode == 0) || map->nocache || (cache_dir == NULL) )
 		return 0;
 	
 	char buf[PATH_MAX+1+1024];
+	jit_cache_hdr_t hdr;
 	int fd = sys_open(get_cache_filename(buf, map, -1), O_RDONLY, 0);
 	if (fd < 0)
 		return -1;
 
-	unsigned long size = fd_filesize(fd);
+	/* only grow the jit memory for a file which checks out */
+	if ( (read_cache_hdr(fd, &hdr, map, fd_filesize(fd)) < 0) ||
+	     ( (hdr.jit_len > jit_mem_size(map->jit_addr)) &&
+	       (hdr.jit_len > jit_mem_try_resize(map->jit_addr, hdr.jit_len)) ) )
+	{
+		sys_close(fd);
+		return -1;
+	}
 
-	char *addr = (char *)sys_mmap2(map->jit_addr, PAGE_NEXT(size),
+	char *addr = (char *)sys_mmap2(map->jit_addr, hdr.jit_len,
 	                               PROT_READ|PROT_EXEC, MAP_PRIVATE|MAP_FIXED,
-	                               fd, 0);
+	                               fd, hdr.hdr_size/PG_SIZE);
 
 	if (addr != map->jit_addr)
 		die("try_load_jit_cache: mmap failed"); 
 
+	if ( check_cache_chunks(fd, &hdr, map->jit_addr) != 0 )
+	{
+		/* back to the anonymous memory we got from jit_mem_alloc() */
+		addr = (char *)sys_mmap2(map->jit_addr, hdr.jit_len,
+		                         PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_FIXED|MAP_ANONYMOUS,
+		                         -1, 0);
+
+		if (addr != map->jit_addr)
+			die("try_load_jit_cache: mmap failed"); 
+
+		sys_close(fd);
+		return -1;
+	}
+
 	sys_close(fd);
 
-	jit_resize(map, size);
+	/* the access time is used for LRU eviction */
+	sys_utimes(buf, NULL);
+
+	jit_resize(map, hdr.jit_len);
+	map->saved_len = map->jit_len;
 	return -1;
 }
 
+/* writes the chunk index, followed by the index entry for the padding chunk
+ * if there is one, and fills in hdr->hdr_sum
+ */
+static long write_cache_index(int fd, jit_cache_hdr_t *hdr, code_map_t *map,
+                              unsigned long pad_len)
+{
+	jit_chunk_info_t index[INDEX_BATCH];
+	unsigned long n = 0, off = sizeof(*hdr), jit_off = 0;
+	unsigned long long sum;
+	long size;
+	int ret;
+
+	hdr->hdr_sum = 0;
+	sum = fnv_hash(hdr, sizeof(*hdr), FNV_INIT);
+
+	do
+	{
+		ret = jit_next_chunk(map->jit_addr, map->jit_len, &jit_off, &index[n]);
+
+		if (ret < 0)
+			return -1;
+
+		if ( (ret == 0) && pad_len )
+		{
+			index[n] = (jit_chunk_info_t) { .jit_off = map->jit_len, .jit_len = pad_len };
+			pad_len = 0;
+			ret = 1;
+		}
+
+		n += ret;
+
+		if ( (n == INDEX_BATCH) || (ret == 0) )
+		{
+			size = n*sizeof(*index);
+			if ( write_at(fd, off, index, size) != size )
+				return -1;
+
+			sum = fnv_hash(index, size, sum);
+			off += size;
+			n = 0;
+		}
+	}
+	while (ret);
+
+	hdr->hdr_sum = sum;
+	return 0;
+}
+
 int try_save_jit_cache(code_map_t *map)
 {
-	if ( (map->inode == 0) || (cache_dir == NULL) )
+	if ( (map->inode == 0) || map->nocache || (cache_dir == NULL) )
 		return 0;
 
 	long ret = -1;
 
 	char tmpfile_buf[PATH_MAX+1],
-	     finalfile_buf[PATH_MAX+1];
+	     finalfile_buf[PATH_MAX+1],
+	     pad[PG_SIZE];
+
+	jit_cache_hdr_t hdr;
+	jit_chunk_info_t info;
+	unsigned long n_chunks = 0, jit_off = 0;
+
+	/* pad the code to a page boundary with an empty chunk, chunks are
+	 * 64 byte aligned, so there is always room for its header.
+	 */
+	unsigned long pad_len = PAGE_NEXT(map->jit_len) - map->jit_len;
+
+	while (jit_next_chunk(map->jit_addr, map->jit_len, &jit_off, &info) == 1)
+		n_chunks++;
+
+	if (pad_len)
+	{
+		jit_padding_chunk(pad, pad_len);
+		n_chunks++;
+	}
+
+	init_cache_hdr(&hdr, map);
+	hdr.hdr_size = PAGE_NEXT(sizeof(hdr)+n_chunks*sizeof(info));
+	hdr.jit_len = map->jit_len + pad_len;
+	hdr.n_chunks = n_chunks;
+	hdr.code_sum = fnv_hash(pad, pad_len, fnv_hash(map->jit_addr, map->jit_len, FNV_INIT));
 
 	char *tmpfile   = get_cache_filename(tmpfile_buf, map, sys_gettid()),
 	     *finalfile = get_cache_filename(finalfile_buf, map, -1);
@@ -142,10 +389,45 @@ int try_save_jit_cache(code_map_t *map)
 	if (fd < 0)
 		return fd;
 
-	if ( sys_write(fd, map->jit_addr, map->jit_len) == (long)map->jit_len )
+	if ( (write_at(fd, hdr.hdr_size, map->jit_addr, map->jit_len) == (long)map->jit_len) &&
+	     (sys_write(fd, pad, pad_len) == (long)pad_len) &&
+	     (write_cache_index(fd, &hdr, map, pad_len) == 0) &&
+	     (write_at(fd, 0, &hdr, sizeof(hdr)) == sizeof(hdr)) )
 		ret = sys_rename(tmpfile, finalfile);
+	else
+		sys_unlink(tmpfile);
+
+	if (ret == 0)
+		jit_cache_written(fd_filesize(fd));
 
 	sys_close(fd);
+
 	return ret;
 }
 
+#define SAVE_MIN_GROWTH (0x10000)
+
+/* Called after code has been added to map. Rewriting the cache file
+ * after every translation makes warm-up I/O quadratic, so it is only
+ * rewritten once the unsaved code is as large as the saved part. The
+ * rest is written by jit_cache_flush() when the map goes away or the
+ * process exits.
+ */
+void jit_cache_update(code_map_t *map)
+{
+	unsigned long unsaved = map->jit_len - map->saved_len;
+
+	if ( (unsaved >= SAVE_MIN_GROWTH) && (unsaved >= map->saved_len) )
+		jit_cache_flush(map);
+}
+
+void jit_cache_flush(code_map_t *map)
+{
+	if ( (map->jit_addr == NULL) || (map->jit_len == map->saved_len) )
+		return;
+
+	try_save_jit_cache(map);
+
+	/* do not retry failed saves before new code is added */
+	map->saved_len = map->jit_len;
+}
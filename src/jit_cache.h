@@ -20,11 +20,57 @@
 #define JIT_CACHE_H
 
 #include "codemap.h"
+#include "jit.h"
+
+/* jit cache file layout:
+ *
+ * offset
+ * -----------------------
+ * 0x00                header
+ * sizeof(header)      chunk index, n_chunks entries, in jit code order
+ * hdr_size            (page aligned) jit code, jit_len bytes, mapped
+ *                     directly at jit_addr, ends with an empty chunk
+ *                     so that jit_len is page aligned
+ * -----------------------
+ *
+ * hdr_sum covers the header (with hdr_sum set to 0) and the chunk index,
+ * code_sum covers the jit code.
+ */
+
+#define JIT_CACHE_MAGIC "minemujc"
+#define JIT_CACHE_VERSION (5)
+
+typedef struct
+{
+	char magic[8];
+	unsigned long version, hdr_size;
+	unsigned long long build_id;
+
+	/* translation settings */
+	unsigned long taint_flag, call_strategy;
+
+	/* code map, hooks are part of map_hash */
+	unsigned long long map_hash;
+	unsigned long addr, len, jit_addr, jit_len;
+
+	unsigned long n_chunks;
+	unsigned long long code_sum, hdr_sum;
+
+} jit_cache_hdr_t;
+
+unsigned long long get_build_id(void);
 
 void set_jit_cache_dir(const char *dir);
 char *get_jit_cache_dir(void);
 
+int set_jit_cache_size(const char *size);
+char *get_jit_cache_size(void);
+int jit_cache_gc(int verify);
+void jit_cache_written(unsigned long long size);
+
 int try_load_jit_cache(code_map_t *map);
 int try_save_jit_cache(code_map_t *map);
+void jit_cache_update(code_map_t *map);
+void jit_cache_flush(code_map_t *map);
 
 #endif /* JIT_CACHE_H */
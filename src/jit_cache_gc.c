@@ -0,0 +1,324 @@
+
+/* This file is part of minemu
+ *
+ * Copyright 2010-2011 Erik Bosman <erik@minemu.org>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* jit cache directory maintenance:
+ *
+ * - files written by another minemu build (or format) are removed, on
+ *   -cachegc also files whose jit code does not match its checksum
+ * - temp files of processes which no longer exist are removed
+ * - if a size limit is set, the least recently used files are removed
+ *   until the cache fits. Loading a file touches it (see
+ *   try_load_jit_cache()), so the access time tells when it was last used.
+ */
+
+#include <linux/limits.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/time.h>
+
+#include "jit_cache.h"
+#include "lib.h"
+#include "syscalls.h"
+#include "error.h"
+#include "kernel_compat.h"
+
+#ifndef O_NOATIME
+#define O_NOATIME (01000000)
+#endif
+
+#define SUFFIX ".jitcache"
+#define SUFFIX_LEN (sizeof(SUFFIX)-1)
+
+#define GC_BATCH (256)
+#define GC_NAME_MAX (96)
+
+static unsigned long long cache_size = 0;
+
+/* size of the cache directory at our last scan, plus what we wrote since */
+static unsigned long long tracked_total = 0;
+static int tracked = 0;
+static char cache_size_buf[32];
+
+typedef struct
+{
+	unsigned long atime;
+	unsigned long long size;
+	char name[GC_NAME_MAX];
+
+} gc_entry_t;
+
+typedef struct
+{
+	unsigned long long total, freed;
+	unsigned long removed, n;
+	int verify;
+	gc_entry_t oldest[GC_BATCH]; /* sorted, oldest first */
+
+} gc_state_t;
+
+/* SIZE in bytes, with an optional K, M or G suffix */
+int set_jit_cache_size(const char *s)
+{
+	const char *p = s;
+	unsigned long long size = 0;
+
+	for (; (*p >= '0') && (*p <= '9'); p++)
+		size = size*10 + (*p-'0');
+
+	if ( (p == s) || (strlen(s) >= sizeof(cache_size_buf)) )
+		return -1;
+
+	switch (*p)
+	{
+		case 'k': case 'K': size <<= 10; p++; break;
+		case 'm': case 'M': size <<= 20; p++; break;
+		case 'g': case 'G': size <<= 30; p++; break;
+		default: break;
+	}
+
+	if (*p != '\0')
+		return -1;
+
+	strcpy(cache_size_buf, s);
+	cache_size = size;
+	return 0;
+}
+
+char *get_jit_cache_size(void)
+{
+	return cache_size ? cache_size_buf : NULL;
+}
+
+/* thread id of the writer for temp files, 0 for cache files */
+static long temp_file_tid(const char *name, unsigned long len)
+{
+	const char *end = &name[len-SUFFIX_LEN], *p = end;
+	long tid = 0;
+
+	while ( (p > name) && (p[-1] >= '0') && (p[-1] <= '9') )
+		p--;
+
+	if ( (p == end) || (p-name < 3) || (strncmp(p-3, "pid", 3) != 0) )
+		return 0;
+
+	for (; p<end; p++)
+		tid = tid*10 + (*p-'0');
+
+	return tid;
+}
+
+/* loading a file only checks the header and index, see try_load_jit_cache() */
+static int code_sum_ok(int fd, jit_cache_hdr_t *hdr)
+{
+	char buf[4096];
+	unsigned long long sum = FNV_INIT;
+	unsigned long off, n;
+
+	for (off=0; off<hdr->jit_len; off+=n)
+	{
+		n = hdr->jit_len-off;
+		if (n > sizeof(buf))
+			n = sizeof(buf);
+
+		if ( read_at(fd, hdr->hdr_size+off, buf, n) != (long)n )
+			return 0;
+
+		sum = fnv_hash(buf, n, sum);
+	}
+
+	return sum == hdr->code_sum;
+}
+
+static int is_current(int fd, unsigned long long size, int verify)
+{
+	jit_cache_hdr_t hdr;
+
+	return (read_at(fd, 0, &hdr, sizeof(hdr)) == sizeof(hdr)) &&
+	       (memcmp(hdr.magic, JIT_CACHE_MAGIC, sizeof(hdr.magic)) == 0) &&
+	       (hdr.version == JIT_CACHE_VERSION) &&
+	       (hdr.build_id == get_build_id()) &&
+	       ((unsigned long long)hdr.hdr_size+hdr.jit_len == size) &&
+	       (!verify || code_sum_ok(fd, &hdr));
+}
+
+static void remove_file(gc_state_t *gc, char *path, unsigned long long size)
+{
+	if (sys_unlink(path) == 0)
+	{
+		gc->removed++;
+		gc->freed += size;
+	}
+}
+
+static void add_oldest(gc_state_t *gc, char *name, unsigned long atime,
+                                                  unsigned long long size)
+{
+	unsigned long i = gc->n;
+
+	if ( (i == GC_BATCH) && (gc->oldest[i-1].atime <= atime) )
+		return;
+
+	if (i == GC_BATCH)
+		i--;
+	else
+		gc->n++;
+
+	for (; (i > 0) && (gc->oldest[i-1].atime > atime); i--)
+		gc->oldest[i] = gc->oldest[i-1];
+
+	gc->oldest[i].atime = atime;
+	gc->oldest[i].size = size;
+	strcpy(gc->oldest[i].name, name);
+}
+
+static void scan_file(gc_state_t *gc, char *dir, char *name)
+{
+	char path[PATH_MAX+1];
+	struct kernel_stat64 s;
+	unsigned long len = strlen(name);
+	long tid;
+	int fd, current, noatime = 0;
+
+	if ( (len <= SUFFIX_LEN) || (strcmp(&name[len-SUFFIX_LEN], SUFFIX) != 0) ||
+	     (strlen(dir)+1+len > PATH_MAX) )
+		return;
+
+	strcpy(path, dir);
+	strcat(path, "/");
+	strcat(path, name);
+
+	/* reading the header must not count as a use of the file, O_NOATIME
+	 * only works for the owner, otherwise we put the access time back
+	 */
+	if ( (fd = sys_open(path, O_RDONLY|O_NOFOLLOW|O_NOATIME, 0)) >= 0 )
+		noatime = 1;
+	else if ( (fd = sys_open(path, O_RDONLY|O_NOFOLLOW, 0)) < 0 )
+		return;
+
+	if ( (sys_fstat64(fd, &s) < 0) || !S_ISREG(s.st_mode) )
+	{
+		sys_close(fd);
+		return;
+	}
+
+	current = is_current(fd, s.st_size, gc->verify);
+	sys_close(fd);
+
+	if (!noatime)
+	{
+		struct timeval times[2] =
+		{
+			{ .tv_sec = s.st_atime, .tv_usec = s.st_atime_nsec/1000 },
+			{ .tv_sec = s.st_mtime, .tv_usec = s.st_mtime_nsec/1000 },
+		};
+		sys_utimes(path, times);
+	}
+
+	if ( (tid = temp_file_tid(name, len)) )
+	{
+		if (sys_kill(tid, 0) == -ESRCH)
+			remove_file(gc, path, s.st_size);
+		else
+			gc->total += s.st_size;
+	}
+	else if (!current)
+		remove_file(gc, path, s.st_size);
+	else
+	{
+		gc->total += s.st_size;
+
+		if (len < GC_NAME_MAX)
+			add_oldest(gc, name, s.st_atime, s.st_size);
+	}
+}
+
+static int scan_dir(gc_state_t *gc, char *dir)
+{
+	char buf[4096];
+	struct kernel_dirent64 *d;
+	long n, off;
+	int fd = sys_open(dir, O_RDONLY|O_DIRECTORY, 0);
+
+	if (fd < 0)
+		return fd;
+
+	gc->total = 0;
+	gc->n = 0;
+
+	while ( (n = sys_getdents64(fd, buf, sizeof(buf))) > 0 )
+		for (off=0; off<n; off+=d->d_reclen)
+		{
+			d = (struct kernel_dirent64 *)&buf[off];
+			scan_file(gc, dir, d->d_name);
+		}
+
+	sys_close(fd);
+	return n;
+}
+
+/* verify also checks the jit code of every file, which means reading
+ * all of the cache
+ */
+int jit_cache_gc(int verify)
+{
+	gc_state_t gc = { .removed = 0, .freed = 0, .verify = verify };
+	char path[PATH_MAX+1], *dir = get_jit_cache_dir();
+	unsigned long i, removed;
+	long ret;
+
+	if (dir == NULL)
+		return -1;
+
+	do
+	{
+		if ( (ret = scan_dir(&gc, dir)) < 0 )
+			return ret;
+
+		removed = gc.removed;
+
+		for (i=0; (i<gc.n) && cache_size && (gc.total > cache_size); i++)
+		{
+			strcpy(path, dir);
+			strcat(path, "/");
+			strcat(path, gc.oldest[i].name);
+			remove_file(&gc, path, gc.oldest[i].size);
+			gc.total -= gc.oldest[i].size;
+		}
+	}
+	while ( cache_size && (gc.total > cache_size) && (gc.n == GC_BATCH) &&
+	        (gc.removed != removed) );
+
+	tracked_total = gc.total;
+	tracked = 1;
+
+	return gc.removed;
+}
+
+/* Called after writing a cache file of size bytes. Only scans the
+ * directory when our own estimate of its size exceeds the limit, other
+ * processes writing to the cache do the same.
+ */
+void jit_cache_written(unsigned long long size)
+{
+	tracked_total += size;
+
+	if ( cache_size && ( !tracked || (tracked_total > cache_size) ) )
+		jit_cache_gc(0);
+}
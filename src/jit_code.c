@@ -547,6 +547,25 @@ int generate_hook(char *dest, char *addr, hook_func_t func)
 	return len;
 }
 
+/* replaces a guest vDSO function, vdso_stub calls func and returns
+ * to the guest's caller
+ */
+int generate_vdso_call(char *dest, vdso_func_t func, trans_t *trans)
+{
+	int len = gen_code(
+		dest,
+
+		"64 C7 05 L L",              /* movl func, hook */
+
+		offsetof(thread_ctx_t, hook_func), func
+	);
+
+	/* jump into runtime code */
+	len += jump_to(&dest[len], (void *)(long)vdso_stub);
+	*trans = (trans_t){ .len=len };
+	return len;
+}
+
 static int generate_linux_sysenter(char *dest, trans_t *trans)
 {
 	int len = gen_code(
@@ -561,24 +580,61 @@ static int generate_linux_sysenter(char *dest, trans_t *trans)
 	return len;
 }
 
-static int generate_int80(char *dest, instr_t *instr, trans_t *trans)
+static int generate_int80_at(char *dest, char *post_addr, trans_t *trans)
 {
-	/* save origin, original address */
+	/* save origin, original address and the jit address to return to,
+	 * int80_emu() only looks up post_addr if jit code has been removed
+	 */
+	int retaddr_index;
 	int len = gen_code(
 		dest,
 
 		"66 0f ef ed"    /* clear ijmp taint register (pxor %xmm5,%xmm5 */
-		"64 C7 05 L L",     /* movl $post_addr, user_eip */
+		"64 C7 05 L L"      /* movl $post_addr, user_eip */
+		"64 C7 05 L &DEADBEEF", /* movl $post_jit_addr, jit_eip */
 
-		offsetof(thread_ctx_t, user_eip), &instr->addr[instr->len]
+		offsetof(thread_ctx_t, user_eip), post_addr,
+		offsetof(thread_ctx_t, jit_eip), &retaddr_index
 	);
 
 	/* jump into runtime code */
 	len += jump_to(&dest[len], (void *)(long)int80_emu);
 	*trans = (trans_t){ .len=len };
+	imm_to(&dest[retaddr_index], (long)dest+len);
 	return len;
 }
 
+static int generate_int80(char *dest, instr_t *instr, trans_t *trans)
+{
+	return generate_int80_at(dest, &instr->addr[instr->len], trans);
+}
+
+/* int $0x80 which continues at post_addr, followed by a jump there */
+static int generate_int80_jump(char *dest, char *post_addr, trans_t *trans,
+                               char *map, unsigned long map_len)
+{
+	trans_t jmp;
+	int len = generate_int80_at(dest, post_addr, trans);
+	int off = len;
+
+	len += generate_jump(&dest[len], post_addr, &jmp, map, map_len);
+	*trans = (trans_t){ .len=len };
+
+	if (jmp.imm)
+		*trans = (trans_t){ .jmp_addr=jmp.jmp_addr, .imm=off+jmp.imm, .len=len };
+
+	return len;
+}
+
+/* __kernel_vsyscall in the guest's vDSO copy, the syscall returns
+ * directly to the ret at the end of the function
+ */
+int generate_vsyscall(char *dest, char *ret_addr, trans_t *trans,
+                      char *map, unsigned long map_len)
+{
+	return generate_int80_jump(dest, ret_addr, trans, map, map_len);
+}
+
 static int generate_cpuid(char *dest, instr_t *instr, trans_t *trans)
 {
 	/* save origin, jit_address */
@@ -771,6 +827,60 @@ static int generate_icall(char *dest, instr_t *instr, trans_t *trans)
 	return len;
 }
 
+/* call *%gs:0x10, glibc's way of calling __kernel_vsyscall */
+static int is_vsyscall_icall(instr_t *instr)
+{
+	return kernel_vsyscall && (instr->p[2] == 0x65) &&
+	       (instr->p[3] == 0) && (instr->p[4] == 0) &&
+	       (instr->len - instr->mrm == 5) && (instr->addr[instr->mrm] == 0x15) &&
+	       (imm_at(&instr->addr[instr->mrm+1], 4) == 0x10);
+}
+
+/* if the call goes to __kernel_vsyscall, go straight to int80_emu and
+ * continue after the call, otherwise do a normal indirect call
+ */
+static int generate_vsyscall_icall(char *dest, instr_t *instr, trans_t *trans,
+                                   char *map, unsigned long map_len)
+{
+	trans_t icall;
+	char scratch[TRANSLATED_MAX_SIZE];
+	int slow_index, icall_len = generate_icall(scratch, instr, &icall);
+	int len = gen_code(
+		dest,
+
+		"66 0F 3A 22 E1 00"    /* pinsrd $0, %ecx, %xmm4                    */
+		"65 8B 0D 10 00 00 00" /* mov %gs:0x10, %ecx                        */
+		"8D 89 L"              /* lea -__kernel_vsyscall(%ecx), %ecx        */
+		"E3 05"                /* jecxz 1f                                  */
+		"E9 &DEADBEEF"         /* jmp 2f                                    */
+		"66 0F 3A 16 E1 00",   /* 1: pextrd $0, %xmm4, %ecx                 */
+
+		-(long)kernel_vsyscall, &slow_index
+	);
+
+	int off = len;
+	len += generate_int80_jump(&dest[len], &instr->addr[instr->len], trans, map, map_len);
+
+	/* the plain call has to fit as well, with taint tracking it may not */
+	if (len + 6 + icall_len > TRANSLATED_MAX_SIZE)
+		return generate_icall(dest, instr, trans);
+
+	imm_to(&dest[slow_index], len-slow_index-4);
+
+	if (trans->imm)
+		trans->imm += off;
+
+	len += gen_code(
+		&dest[len],
+
+		"66 0F 3A 16 E1 00"    /* 2: pextrd $0, %xmm4, %ecx                 */
+	);
+
+	len += generate_icall(&dest[len], instr, &icall);
+	trans->len = len;
+	return len;
+}
+
 static int generate_ret(char *dest, char *addr, trans_t *trans)
 {
 	int len = jump_to(dest, (void *)(long)runtime_ret);
@@ -828,6 +938,19 @@ int generate_jump(char *dest, char *jmp_addr, trans_t *trans,
 		return generate_cross_map_jump(dest, jmp_addr,  trans);
 }
 
+/* Writes an exit stub at jit_addr which jumps to jmp_addr through the
+ * runtime, and redirects the relative jump with its immediate at
+ * imm_addr to it.
+ */
+int generate_stub(char *jit_addr, char *jmp_addr, char *imm_addr)
+{
+	trans_t trans;
+	int len = generate_cross_map_jump(jit_addr, jmp_addr, &trans);
+	commit();
+	imm_to(imm_addr, (long)jit_addr - (long)imm_addr - 4);
+	return len;
+}
+
 static int generate_jcc(char *dest, char *jmp_addr, int cond, trans_t *trans,
                         char *map, unsigned long map_len)
 {
@@ -1039,7 +1162,10 @@ static void translate_control(char *dest, instr_t *instr, trans_t *trans,
 			generate_ijump(dest, instr, trans);
 			break;
 		case CALL_INDIRECT:
-			generate_icall(dest, instr, trans);
+			if ( is_vsyscall_icall(instr) )
+				generate_vsyscall_icall(dest, instr, trans, map, map_len);
+			else
+				generate_icall(dest, instr, trans);
 			break;
 		case RETURN:
 			generate_ret(dest, instr->addr, trans);
@@ -25,6 +25,7 @@
 #include "lib.h"
 #include "opcodes.h"
 #include "hooks.h"
+#include "vdso.h"
 
 enum
 {
@@ -35,6 +36,9 @@ enum
 
 extern int call_strategy;
 
+/* the translation of a single instruction has to fit in a byte */
+#define TRANSLATED_MAX_SIZE (255)
+
 typedef struct
 {
 	char *jmp_addr;
@@ -55,6 +59,9 @@ void translate_op(char *dest, instr_t *instr, trans_t *trans,
                   char *map, unsigned long map_len);
 
 int generate_hook(char *dest, char *addr, hook_func_t func);
+int generate_vdso_call(char *dest, vdso_func_t func, trans_t *trans);
+int generate_vsyscall(char *dest, char *ret_addr, trans_t *trans,
+                      char *map, unsigned long map_len);
 
 int generate_jump(char *jit_addr, char *dest, trans_t *trans, char *map, unsigned long map_len);
 int generate_stub(char *jit_addr, char *jmp_addr, char *imm_addr);
@@ -183,18 +183,49 @@ static char *jit_fragment_translate(char *addr, long len, char *entry,
 	return jit_entry;
 }
 
+/* signals tend to hit the same hot instruction over and over, returns
+ * the entry in the fragment built for it last time, or NULL
+ */
+static char *jit_fragment_cached(char *fragment, long len, char *entry)
+{
+	thread_ctx_t *local_ctx = get_thread_ctx();
+	fragment_cache_t *cache = &local_ctx->fragment_cache;
+
+	if ( (cache->op == fragment) && (cache->len == len) &&
+	     (memcmp(cache->code, fragment, len) == 0) &&
+	     (cache->entry[entry-fragment] != 0xffff) )
+		return &local_ctx->jit_fragment_page[cache->entry[entry-fragment]];
+
+	return NULL;
+}
+
+/* called with the fragment page writable */
 static char *jit_fragment(char *fragment, long len, char *entry)
 {
 	thread_ctx_t *local_ctx = get_thread_ctx();
+	fragment_cache_t *cache = &local_ctx->fragment_cache;
 	char *jit_entry;
 	char *mapping[len+1];
 	char *jit_fragment_page = local_ctx->jit_fragment_page;
-	long code_sz = sizeof( local_ctx->jit_fragment_page );
+	long code_sz = sizeof( local_ctx->jit_fragment_page ), i;
+
+	cache->op = NULL;
+	memset(mapping, 0, sizeof(mapping));
 
 	/* two-pass, we build up the jump-mapping beforehand */
 	            jit_fragment_translate(fragment, len, entry, jit_fragment_page, code_sz, mapping);
 	jit_entry = jit_fragment_translate(fragment, len, entry, jit_fragment_page, code_sz, mapping);
 
+	if (len <= FRAGMENT_CACHE_MAX)
+	{
+		for (i=0; i<=len; i++)
+			cache->entry[i] = mapping[i] ? mapping[i]-jit_fragment_page : 0xffff;
+
+		memcpy(cache->code, fragment, len);
+		cache->len = len;
+		cache->op = fragment;
+	}
+
 	return jit_entry;
 }
 
@@ -207,8 +238,9 @@ char *jit_fragment_run(struct sigcontext *context);
 char *finish_instruction(struct sigcontext *context)
 {
 	thread_ctx_t *local_ctx = get_thread_ctx();
-	char *orig_eip, *jit_op_start;
+	char *orig_eip, *jit_op_start, *jit_entry;
 	long jit_op_len, i;
+	int redirected = 0;
 
 	local_ctx->jit_fragment_restartsys = 0;
 
@@ -218,39 +250,67 @@ char *finish_instruction(struct sigcontext *context)
 
 		if ( orig_eip && (char *)context->eip == jit_op_start )
 		{
+			if (redirected)
+			{
+				unprotect_ctx();
+				local_ctx->runtime_ijmp_addr = runtime_ijmp;
+				local_ctx->jit_return_addr = jit_return;
+				protect_ctx();
+			}
+
 			if (local_ctx->jit_fragment_restartsys)
 				orig_eip -= 2;
 
 			return orig_eip;
 		}
 
-		unprotect_ctx();
+		jit_entry = NULL;
+		if ( orig_eip )
+			jit_entry = jit_fragment_cached(jit_op_start, jit_op_len, (char *)context->eip);
+
+		/* the page is never writable and executable at the same time,
+		 * the redirection stays in place for all passes
+		 */
+		if ( !redirected || (orig_eip && !jit_entry) )
+		{
+			unprotect_ctx();
+
+			if (!redirected)
+			{
+				local_ctx->runtime_ijmp_addr = reloc_runtime_ijmp;
+				local_ctx->jit_return_addr = reloc_jit_return;
+				redirected = 1;
+			}
+
+			if ( orig_eip && !jit_entry )
+				/* jit the jit! */
+				jit_entry = jit_fragment(jit_op_start, jit_op_len, (char *)context->eip);
+
+			protect_ctx();
+		}
 
 		if ( orig_eip )
-			/* jit the jit! */
-			context->eip = (long)jit_fragment(jit_op_start, jit_op_len, (char *)context->eip);
+			context->eip = (long)jit_entry;
 
 		else if ( between(syscall_intr_critical_start,
 		                  syscall_intr_critical_end, (char *)context->eip) )
 			/* do not go through with a syscall in progress */
 			context->eip = (long)syscall_intr_critical_start;
 
+		else if ( between((char *)(long)int80_emu, int80_fast_syscall, (char *)context->eip) )
+		{
+			/* same for int80_emu's fast path */
+			local_ctx->jit_fragment_restartsys = 1;
+			context->eip = (context->eip == (unsigned long)int80_emu) ?
+			               (long)int80_fast_skip_entry : (long)int80_fast_skip;
+		}
+
 		else if ( between(runtime_cache_resolution_start,
 		                  runtime_cache_resolution_end, (char *)context->eip) )
 			/* instead of jumping directly to the resolved address, return here */
 			context->eip += reloc_runtime_cache_resolution_start-runtime_cache_resolution_start;
 
-		local_ctx->runtime_ijmp_addr = reloc_runtime_ijmp;
-		local_ctx->jit_return_addr = reloc_jit_return;
-
-		protect_ctx();
 		jit_fragment_run(context);
-		unprotect_ctx();
-
-		local_ctx->runtime_ijmp_addr = runtime_ijmp;
-		local_ctx->jit_return_addr = jit_return;
-
-		protect_ctx();
 
 		if (context->fpstate) /* very likely :-) */
 		{
@@ -263,4 +323,3 @@ char *finish_instruction(struct sigcontext *context)
 	die("instruction pointer (%x) not at opcode start after jit_fragment_run()", orig_eip);
 	return NULL;
 }
-
@@ -25,13 +25,19 @@
 #include "syscalls.h"
 
 #include "jit.h"
+#include "jit_mm.h"
 #include "codemap.h"
 #include "jmp_cache.h"
 #include "opcodes.h"
 #include "error.h"
 #include "runtime.h"
+#include "threads.h"
+#include "stats.h"
 
 #define BLOCK_SIZE 65536
+#define MAX_BLOCKS (JIT_SIZE/BLOCK_SIZE)
+#define N_BINS (16)
+#define NONE (-1)
 
 /* Blocks[i] is negative for blocks i which are the start
  * of an allocated region, -blocks[i] gives the number of blocks
@@ -40,23 +46,38 @@
  * Blocks[i] is positive for the start of an unallocated
  * region and gives the number of free blocks until the next
  * allocated region (or until the end of JIT code memory.)
+ *
+ * Heads[j] is the start of the region which ends with block j,
+ * so freed regions can be merged with the free space before them.
  */
-static short blocks[JIT_SIZE/BLOCK_SIZE + 1];
+static short blocks[MAX_BLOCKS + 1];
+static short heads[MAX_BLOCKS];
 static long n_blocks;
 static unsigned long block_size;
 
+/* Free regions indexed by size, bins[b] is a list of all free regions
+ * of 2^b up to 2^(b+1) blocks, linked through next_free/prev_free
+ */
+static short bins[N_BINS];
+static short next_free[MAX_BLOCKS], prev_free[MAX_BLOCKS];
+static long n_free;
+
+/* the allocator does not depend on jit_lock */
+static long jit_mem_lock = 0;
+
+static void init_blocks(void);
+
 void jit_mem_init(void)
 {
-	block_size = BLOCK_SIZE;
-	n_blocks = JIT_SIZE/block_size;
-	memset(blocks, 0, sizeof(blocks));
-	blocks[0] = n_blocks;
-	blocks[n_blocks] = 0;
+	mutex_lock(&jit_mem_lock);
+	init_blocks();
+	mutex_unlock(&jit_mem_lock);
 }
 
 void print_jit_stats(void)
 {
 	long i;
+	mutex_lock(&jit_mem_lock);
 	for (i=0;i<n_blocks;)
 	{
 		if (blocks[i] < 0)
@@ -70,8 +91,10 @@ void print_jit_stats(void)
 			i += blocks[i];
 		}
 	}
+	mutex_unlock(&jit_mem_lock);
 }
 
+/* called with jit_mem_lock held */
 static int get_alloc_block(void *p)
 {
 	unsigned long offset = (unsigned long)p - JIT_START;
@@ -98,6 +121,11 @@ static void *get_alloc_pointer(long i)
 	return (void *)(JIT_START + i * block_size);
 }
 
+static long blocks_needed(unsigned long size)
+{
+	return (size+block_size+(size?-1:0))/block_size;
+}
+
 static void use_blocks(long i, long count)
 {
 	long ret = sys_mprotect(get_alloc_pointer(i), count*block_size,
@@ -116,100 +144,233 @@ static void disuse_blocks(long i, long count)
 		die("disuse_blocks(): mmap: %d", ret);
 }
 
-static long get_max_index(void)
+static int get_bin(long count)
 {
-	long max_blocks = 0, max_index = -1, i;
+	int b = 0;
 
-	for (i=0;i<n_blocks;)
+	while ( (count >>= 1) && (b < N_BINS-1) )
+		b++;
+
+	return b;
+}
+
+/* count is negative for allocated regions */
+static void set_region(long i, long count)
+{
+	blocks[i] = count;
+	heads[i + (count < 0 ? -count : count) - 1] = i;
+}
+
+static void index_free(long i)
+{
+	int b = get_bin(blocks[i]);
+
+	prev_free[i] = NONE;
+	next_free[i] = bins[b];
+	if (bins[b] != NONE)
+		prev_free[bins[b]] = i;
+	bins[b] = i;
+
+	n_free += blocks[i];
+}
+
+static void unindex_free(long i)
+{
+	if (prev_free[i] != NONE)
+		next_free[prev_free[i]] = next_free[i];
+	else
+		bins[get_bin(blocks[i])] = next_free[i];
+
+	if (next_free[i] != NONE)
+		prev_free[next_free[i]] = prev_free[i];
+
+	n_free -= blocks[i];
+}
+
+/* turns [i, i+count) into free space, merged with free neighbours */
+static void add_free(long i, long count)
+{
+	long next = i+count, prev;
+
+	if (blocks[next] > 0) /* next region is free space */
 	{
-		if (blocks[i] > 0)
-		{
-			if (blocks[i] > max_blocks)
-			{
-				max_blocks = blocks[i];
-				max_index = i;
-			}
-			i += blocks[i];
-		}
-		else
-			i -= blocks[i];
+		unindex_free(next);
+		count += blocks[next];
+		blocks[next] = 0;
 	}
 
-	return max_index;
+	if ( (i > 0) && (blocks[prev = heads[i-1]] > 0) )
+	{
+		unindex_free(prev);
+		blocks[i] = 0;
+		count += i-prev;
+		i = prev;
+	}
+
+	set_region(i, count);
+	index_free(i);
 }
 
-void *jit_mem_balloon(void *p)
+/* takes the first count blocks of the free region at i, the caller
+ * marks them as allocated
+ */
+static void take_free(long i, long count)
 {
-	long base, new;
+	long rest = blocks[i]-count;
+
+	unindex_free(i);
+	blocks[i] = 0;
 
-	if (p)
+	if (rest > 0)
 	{
-		base = get_alloc_block(p);
-		new = base + -blocks[base];
+		set_region(i+count, rest);
+		index_free(i+count);
 	}
-	else
+
+	use_blocks(i, count);
+
+	if ( (n_blocks-n_free)*block_size > stats.jit_mem_peak )
+		stats.jit_mem_peak = (n_blocks-n_free)*block_size;
+}
+
+static void init_blocks(void)
+{
+	int b;
+
+	block_size = BLOCK_SIZE;
+	n_blocks = MAX_BLOCKS;
+	n_free = 0;
+	memset(blocks, 0, sizeof(blocks));
+
+	for (b=0; b<N_BINS; b++)
+		bins[b] = NONE;
+
+	set_region(0, n_blocks);
+	index_free(0);
+	blocks[n_blocks] = 0;
+}
+
+static long get_max_index(void)
+{
+	long max_index = NONE, i;
+	int b;
+
+	for (b=N_BINS-1; (b>=0) && (max_index == NONE); b--)
+		for (i=bins[b]; i!=NONE; i=next_free[i])
+			if ( (max_index == NONE) || (blocks[i] > blocks[max_index]) )
+				max_index = i;
+
+	return max_index;
+}
+
+/* returns the total amount of free jit memory, *largest is set
+ * to the size of the largest free region
+ */
+unsigned long jit_mem_unused(unsigned long *largest)
+{
+	mutex_lock(&jit_mem_lock);
+	long i = get_max_index();
+	*largest = (i == NONE) ? 0 : blocks[i]*block_size;
+	unsigned long unused = n_free*block_size;
+	mutex_unlock(&jit_mem_lock);
+	return unused;
+}
+
+/* best fit, returns NULL if no free region is large enough */
+void *jit_mem_alloc(unsigned long size)
+{
+	long count = blocks_needed(size), best = NONE, i;
+	int b;
+
+	mutex_lock(&jit_mem_lock);
+
+	for (b=get_bin(count); (b<N_BINS) && (best == NONE); b++)
+		for (i=bins[b]; i!=NONE; i=next_free[i])
+			if ( (blocks[i] >= count) &&
+			     ( (best == NONE) || (blocks[i] < blocks[best]) ) )
+				best = i;
+
+	if (best == NONE)
 	{
-		base = new = get_max_index();
-		if (base == -1)
-			return NULL;
-		
-		p = get_alloc_pointer(base);
+		stats.jit_mem_failed++;
+		mutex_unlock(&jit_mem_lock);
+		return NULL;
 	}
 
+	take_free(best, count);
+	set_region(best, -count);
+	stats.jit_mem_allocs++;
+
+	mutex_unlock(&jit_mem_lock);
+	return get_alloc_pointer(best);
+}
+
+/* grows p's region by all the free space directly after it */
+void *jit_mem_balloon(void *p)
+{
+	mutex_lock(&jit_mem_lock);
+
+	long base = get_alloc_block(p);
+	long count = -blocks[base], new = base + count;
+
 	if (blocks[new] > 0)
 	{
-		use_blocks(new, blocks[new]);
-		long newblocks = blocks[new];
-		blocks[new] = 0;
-		blocks[base] -= newblocks;
+		count += blocks[new];
+		take_free(new, blocks[new]);
+		set_region(base, -count);
 	}
 
+	mutex_unlock(&jit_mem_lock);
 	return p;
 }
 
+/* blocks[] around p may be rewritten by frees and balloons of other
+ * regions at the same time
+ */
 unsigned long jit_mem_size(void *p)
 {
-	return -blocks[get_alloc_block(p)]*block_size;
+	mutex_lock(&jit_mem_lock);
+	unsigned long size = -blocks[get_alloc_block(p)]*block_size;
+	mutex_unlock(&jit_mem_lock);
+	return size;
 }
 
 unsigned long jit_mem_try_resize(void *p, unsigned long requested_size)
 {
-	long base, next, newnext;
-	base = get_alloc_block(p);
-	next = base + -blocks[base];
-
-	long diff = (requested_size+block_size+(requested_size?-1:0))/block_size -
-	            -blocks[base];
+	mutex_lock(&jit_mem_lock);
 
-	newnext = next + diff;
+	long base = get_alloc_block(p);
+	long count = -blocks[base], next = base+count;
+	long diff = blocks_needed(requested_size) - count;
 
 	if ( diff < 0 )
 	{
-		blocks[newnext] = -diff;
-		disuse_blocks(newnext, -diff);
-		if (blocks[next] > 0) /* next region is free space */
-		{
-			blocks[newnext] += blocks[next];
-			blocks[next] = 0;
-		}
-		blocks[base] -= diff;
+		set_region(base, -(count+diff));
+		disuse_blocks(next+diff, -diff);
+		add_free(next+diff, -diff);
 	}
 
-	if ( diff > 0 )
+	if ( (diff > 0) && (blocks[next] > 0) ) /* next region is free space */
 	{
-		if (blocks[next] > 0) /* next region is free space */
-		{
-			if (blocks[next] < diff)
-				diff = blocks[next]; /* since it's best effort */
+		if (blocks[next] < diff)
+			diff = blocks[next]; /* since it's best effort */
 
-			use_blocks(next, diff);
-			blocks[newnext] = blocks[next] - diff;
-			blocks[next] = 0;
-			blocks[base] -= diff;
-		}
+		take_free(next, diff);
+		set_region(base, -(count+diff));
 	}
 
-	return -blocks[base]*block_size;
+	unsigned long size = -blocks[base]*block_size;
+	mutex_unlock(&jit_mem_lock);
+	return size;
+}
+
+/* frees all jit memory */
+void jit_mem_reset(void)
+{
+	mutex_lock(&jit_mem_lock);
+	disuse_blocks(0, n_blocks);
+	init_blocks();
+	mutex_unlock(&jit_mem_lock);
 }
 
 void jit_mem_free(void *p)
@@ -217,15 +378,13 @@ void jit_mem_free(void *p)
 	if (!p)
 		return;
 
-	long base, next;
-	base = get_alloc_block(p);
-	blocks[base] = -blocks[base];
-	disuse_blocks(base, blocks[base]);
+	mutex_lock(&jit_mem_lock);
 
-	while ( (next=base+blocks[base]) < n_blocks && blocks[next] > 0 )
-	{
-		blocks[base] += blocks[next];
-		blocks[next] = 0;
-	}
-}
+	long base = get_alloc_block(p);
+	long count = -blocks[base];
+	disuse_blocks(base, count);
+	add_free(base, count);
+	stats.jit_mem_frees++;
 
+	mutex_unlock(&jit_mem_lock);
+}
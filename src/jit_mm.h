@@ -21,9 +21,12 @@
 
 void jit_mem_init(void);
 
+void *jit_mem_alloc(unsigned long size);
 void jit_mem_free(void *p);
-void *jit_mem_balloon(void *p); /* get largest possible memory region */
+void jit_mem_reset(void);
+void *jit_mem_balloon(void *p); /* grow into all adjacent free memory */
 unsigned long jit_mem_size(void *p);
 unsigned long jit_mem_try_resize(void *p, unsigned long requested_size);
+unsigned long jit_mem_unused(unsigned long *largest);
 
 #endif /* JIT_MM_H */
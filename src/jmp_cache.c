@@ -23,51 +23,196 @@
 #include "jmp_cache.h"
 #include "threads.h"
 
-#define MAX_SEARCH 32
-
+/* The newest entry goes into the first way of the set, where the fast
+ * path looks. The others move down a way, evicting the oldest.
+ */
 void add_jmp_mapping(char *addr, char *jit_addr)
 {
-	jmp_map_t *jmp_cache = get_thread_ctx()->jmp_cache;
+	jmp_map_t *set = &get_thread_ctx()->jmp_cache[HASH_INDEX(addr)];
+	int i;
 
-	int hash = HASH_INDEX(addr), i;
-	static int round_robin = 0;
-	round_robin++; round_robin %= MAX_SEARCH;
+	for (i=0; i<JMP_CACHE_WAYS-1; i++)
+		if ( (set[i].addr == CACHE_MANGLE(addr)) || (set[i].addr == NULL) )
+			break;
 
-	for (i=hash; i < hash+MAX_SEARCH; i++)
-		if ( jmp_cache[i&0xffff].addr == NULL )
-		{
-			jmp_cache[i&0xffff] = (jmp_map_t) { .addr = CACHE_MANGLE(addr), .jit_addr = jit_addr };
-			return;
-		}
+	for (; i>0; i--)
+		set[i] = set[i-1];
 
-	jmp_cache[(hash+round_robin)&0xffff] = (jmp_map_t) { .addr = CACHE_MANGLE(addr), .jit_addr = jit_addr };
+	set[0] = (jmp_map_t) { .addr = CACHE_MANGLE(addr), .jit_addr = jit_addr };
 }
 
-void clear_jmp_cache(thread_ctx_t *ctx, char *addr, unsigned long len)
+static void clear_slots(thread_ctx_t *ctx, unsigned long first, unsigned long n,
+                        char *addr, unsigned long len)
 {
 	jmp_map_t *jmp_cache = ctx->jmp_cache;
+	unsigned long i;
 
-	int i;
-	char *tmp_addr, *tmp_jit_addr;
-
-	for (i=0; i<JMP_CACHE_SIZE; i++)
+	for (i=first; i<first+n; i++)
 	{
-		jmp_map_t orig = jmp_cache[i];
+		jmp_map_t orig = jmp_cache[i&(JMP_CACHE_SIZE-1)];
 		if ( contains(addr, len, CACHE_MANGLE(orig.addr)) )
-			atomic_clear_8bytes((char*)&jmp_cache[i], (char*)&orig);
+			atomic_clear_8bytes((char*)&jmp_cache[i&(JMP_CACHE_SIZE-1)], (char*)&orig);
 	}
 }
 
-char *find_jmp_mapping(char *addr)
+/* Consecutive addresses with the same upper half map to consecutive sets,
+ * so small ranges need not scan the whole cache.
+ */
+void clear_jmp_cache(thread_ctx_t *ctx, char *addr, unsigned long len)
 {
-	jmp_map_t *jmp_cache = get_thread_ctx()->jmp_cache;
+	unsigned long piece;
+	char *p;
 
-	int hash = HASH_INDEX(addr), i;
+	if (len >= JMP_CACHE_SIZE/JMP_CACHE_WAYS)
+	{
+		clear_slots(ctx, 0, JMP_CACHE_SIZE, addr, len);
+		return;
+	}
+
+	for (p=addr; p<addr+len; p+=piece)
+	{
+		piece = 0x10000 - ((unsigned long)p & 0xffff);
+		if (piece > (unsigned long)(addr+len-p))
+			piece = addr+len-p;
+
+		clear_slots(ctx, HASH_INDEX(p), piece*JMP_CACHE_WAYS, addr, len);
+	}
+}
+
+char *find_jmp_mapping(char *addr)
+{
+	jmp_map_t *set = &get_thread_ctx()->jmp_cache[HASH_INDEX(addr)];
+	int i;
 
-	for (i=hash; i<hash+MAX_SEARCH; i++)
-		if ( (jmp_cache[i&0xffff].addr == CACHE_MANGLE(addr)) || (jmp_cache[i&0xffff].addr == NULL) )
-			return jmp_cache[i&0xffff].jit_addr;
+	for (i=0; i<JMP_CACHE_WAYS; i++)
+		if (set[i].addr == CACHE_MANGLE(addr))
+			return set[i].jit_addr;
 
 	return NULL;
 }
 
+/* Process-wide second level cache, consulted when a thread's own jump
+ * cache misses so that new threads need not resolve every target the
+ * slow way. Direct mapped, entries are guarded by a sequence number
+ * which is odd while an entry is being written, readers take no locks.
+ */
+#define SHARED_CACHE_BITS (16)
+#define SHARED_CACHE_SIZE (1<<SHARED_CACHE_BITS)
+#define SHARED_INDEX(addr) ( ( (unsigned long)(addr) + \
+                             __builtin_bswap32((unsigned long)(addr)) ) & \
+                           (SHARED_CACHE_SIZE-1) )
+
+typedef struct
+{
+	unsigned long seq;
+	char *addr;
+	char *jit_addr;
+	long pad;
+
+} shared_map_t;
+
+static shared_map_t shared_cache[SHARED_CACHE_SIZE];
+
+/* bumped by every purge, fills which started earlier are dropped */
+static unsigned long shared_gen = 0;
+
+#define barrier() __asm__ __volatile__ ("" ::: "memory")
+
+unsigned long shared_cache_gen(void)
+{
+	return shared_gen;
+}
+
+char *find_shared_mapping(char *addr)
+{
+	shared_map_t *e = &shared_cache[SHARED_INDEX(addr)];
+	unsigned long seq = e->seq;
+	barrier();
+	char *cached_addr = e->addr, *jit_addr = e->jit_addr;
+	barrier();
+
+	if ( (seq & 1) || (cached_addr != addr) || (e->seq != seq) )
+		return NULL;
+
+	return jit_addr;
+}
+
+static int lock_entry(shared_map_t *e, int wait)
+{
+	unsigned long seq;
+
+	do
+	{
+		seq = e->seq;
+		if ( !(seq & 1) && __sync_bool_compare_and_swap(&e->seq, seq, seq+1) )
+			return 1;
+	}
+	while (wait);
+
+	return 0;
+}
+
+static void unlock_entry(shared_map_t *e)
+{
+	barrier();
+	e->seq++;
+}
+
+/* gen is shared_cache_gen() from before the lookup which found jit_addr */
+void add_shared_mapping(char *addr, char *jit_addr, unsigned long gen)
+{
+	shared_map_t *e = &shared_cache[SHARED_INDEX(addr)];
+
+	if ( !lock_entry(e, 0) ) /* someone else is filling it, never mind */
+		return;
+
+	if (gen == shared_gen)
+	{
+		e->addr = addr;
+		e->jit_addr = jit_addr;
+	}
+
+	unlock_entry(e);
+}
+
+static void clear_shared_entry(shared_map_t *e, char *addr, unsigned long len)
+{
+	/* wait for fills in progress, they may be for this range */
+	if ( !(e->seq & 1) && !(e->addr && contains(addr, len, e->addr)) )
+		return;
+
+	lock_entry(e, 1);
+
+	if (e->addr && contains(addr, len, e->addr))
+		e->addr = e->jit_addr = NULL;
+
+	unlock_entry(e);
+}
+
+void clear_shared_cache(char *addr, unsigned long len)
+{
+	unsigned long i, first, piece;
+	char *p;
+
+	__sync_fetch_and_add(&shared_gen, 1);
+
+	if (len >= SHARED_CACHE_SIZE)
+	{
+		for (i=0; i<SHARED_CACHE_SIZE; i++)
+			clear_shared_entry(&shared_cache[i], addr, len);
+
+		return;
+	}
+
+	/* as with clear_jmp_cache(), per 64k of address space */
+	for (p=addr; p<addr+len; p+=piece)
+	{
+		piece = 0x10000 - ((unsigned long)p & 0xffff);
+		if (piece > (unsigned long)(addr+len-p))
+			piece = addr+len-p;
+
+		first = SHARED_INDEX(p);
+		for (i=first; i<first+piece; i++)
+			clear_shared_entry(&shared_cache[i & (SHARED_CACHE_SIZE-1)], addr, len);
+	}
+}
@@ -25,7 +25,18 @@ void add_jmp_mapping(char *addr, char *jit_addr);
 char *find_jmp_mapping(char *addr);
 void clear_jmp_cache(thread_ctx_t *ctx, char *addr, unsigned long len);
 
-#define HASH_INDEX(addr) ((unsigned long)(addr)&0xfffful)
+unsigned long shared_cache_gen(void);
+char *find_shared_mapping(char *addr);
+void add_shared_mapping(char *addr, char *jit_addr, unsigned long gen);
+void clear_shared_cache(char *addr, unsigned long len);
+
+/* Index of the first way of addr's set. The upper half of the address
+ * is mixed in so that code at the same offset in different libraries
+ * does not end up in the same set. Must match runtime_ijmp.
+ */
+#define HASH_INDEX(addr) ( ( ( (unsigned long)(addr) + \
+                               __builtin_bswap32((unsigned long)(addr)) ) * \
+                             JMP_CACHE_WAYS ) & (JMP_CACHE_SIZE-1) )
 
 /* ( address + CACHE_MANGLE(addr) - 1 ) == 0
  * so that we can use lea+jecxz to check for equivalence,
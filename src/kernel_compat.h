@@ -43,6 +43,9 @@ struct kernel_ucontext
 
 typedef void (*kernel_sighandler_t)(int, siginfo_t *, void *);
 
+#define KERNEL_SIG_DFL ((kernel_sighandler_t)0)
+#define KERNEL_SIG_IGN ((kernel_sighandler_t)1)
+
 struct kernel_old_sigaction
 {
 	kernel_sighandler_t handler;
@@ -115,4 +118,12 @@ struct kernel_stat64 {
 	unsigned long long	st_ino;
 };
 
+struct kernel_dirent64 {
+	unsigned long long	d_ino;
+	long long	d_off;
+	unsigned short	d_reclen;
+	unsigned char	d_type;
+	char	d_name[];
+};
+
 #endif /* KERNEL_COMPAT_H */
@@ -302,6 +302,16 @@ long read_at(int fd, off_t off, void *buf, size_t size)
 	return sys_read(fd, buf, size);
 }
 
+long write_at(int fd, off_t off, const void *buf, size_t size)
+{
+	int ret = sys_lseek(fd, off, SEEK_SET);
+
+	if (ret < 0)
+		return ret;
+
+	return sys_write(fd, buf, size);
+}
+
 char *strcat(char *dest, const char *src)
 {
 	char *p=dest;
@@ -478,3 +488,17 @@ long memscan(const char *hay, long haylen, const char *needle, long needlelen)
 	return -1;
 }
 
+/* 64 bit FNV-1a, pass a previous result as h to hash discontiguous data */
+unsigned long long fnv_hash(const void *buf, size_t n, unsigned long long h)
+{
+	const unsigned char *p = buf;
+	size_t i;
+
+	for (i=0; i<n; i++)
+	{
+		h ^= p[i];
+		h *= FNV_PRIME;
+	}
+
+	return h;
+}
@@ -31,6 +31,7 @@ int fd_printf(int fd, const char *format, ...);
 char *getenve(const char *name, char **environment);
 
 long read_at(int fd, off_t off, void *buf, size_t size);
+long write_at(int fd, off_t off, const void *buf, size_t size);
 char *numcat(char *dest, long l);
 char *hexcat(char *dest, unsigned long ul);
 
@@ -45,6 +46,11 @@ int absdir(char *dest, const char *dir);
 
 long memscan(const char *hay, long haylen, const char *needle, long needlelen);
 
+#define FNV_INIT  (0xcbf29ce484222325ULL)
+#define FNV_PRIME (0x100000001b3ULL)
+
+unsigned long long fnv_hash(const void *buf, size_t n, unsigned long long h);
+
 void clear(void *buf, size_t n);
 
 static inline int overlap(const char *addr1, unsigned long len1, const char *addr2, unsigned long len2)
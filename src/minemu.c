@@ -36,6 +36,7 @@
 #include "opcodes.h"
 #include "threads.h"
 #include "jit_cache.h"
+#include "pretranslate.h"
 
 /* not called main() to avoid warnings about extra parameters :-(  */
 int minemu_main(int argc, char *orig_argv[], char *envp[], long auxv[])
@@ -53,6 +54,24 @@ int minemu_main(int argc, char *orig_argv[], char *envp[], long auxv[])
 
 	argv = parse_options(argv);
 
+	if (cache_gc)
+	{
+		long removed = jit_cache_gc(1);
+
+		if (removed < 0)
+			debug("Minemu: cannot clean jit cache (use -cache DIR)");
+		else
+			debug("Minemu: removed %d files from the jit cache", removed);
+
+		sys_exit(removed < 0 ? 1 : 0);
+	}
+
+	if ( pretranslate && (get_jit_cache_dir() == NULL) )
+	{
+		debug("Minemu: -pretranslate requires -cache");
+		sys_exit(1);
+	}
+
 	if ( (progname == NULL) && (argv[0][0] == '/') )
 		progname = argv[0];
 
@@ -61,6 +80,7 @@ int minemu_main(int argc, char *orig_argv[], char *envp[], long auxv[])
 	sigwrap_init();
 	unblock_signals();
 	jit_init();
+	init_syscalls();
 
 	elf_prog_t prog =
 	{
@@ -138,7 +158,11 @@ int minemu_main(int argc, char *orig_argv[], char *envp[], long auxv[])
 
 	long sysinfo = get_aux(prog.auxv, AT_SYSINFO);
 	if (sysinfo)
-		set_aux(prog.auxv, AT_SYSINFO, (sysinfo & 0xfff) + vdso);
+		set_aux(prog.auxv, AT_SYSINFO, sysinfo - vdso_orig + vdso);
+
+	/* stop when the dynamic linker is done loading libraries */
+	if (pretranslate)
+		pretranslate_entry = (char *)get_aux(prog.auxv, AT_ENTRY);
 
 	emu_start(prog.entry, prog.sp);
 
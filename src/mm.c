@@ -38,12 +38,13 @@
 #include "kernel_compat.h"
 #include "threads.h"
 #include "proc.h"
+#include "vdso.h"
 
 /* switch when shadow shared memory is completely done */
 #define SHADOW_DEFAULT_PROT (PROT_NONE)
 //#define SHADOW_DEFAULT_PROT (PROT_READ|PROT_WRITE)
 
-unsigned long vdso, vdso_orig, sysenter_reentry, minemu_stack_bottom, stack_bottom;
+unsigned long vdso, vdso_orig, vdso_size, sysenter_reentry, minemu_stack_bottom, stack_bottom;
 
 long map_lock;
 
@@ -79,14 +80,15 @@ static void shadow_mmap(unsigned long addr, size_t length, long prot, int fd, of
 	if (ret & PG_MASK)
 		die("shadow_m{,un}map(): %08x\n", ret);
 
-	if ( (prot & PROT_EXEC) && !(prot & PROT_WRITE) )
+	if (prot & PROT_EXEC)
 	{
 		struct kernel_stat64 s;
 		if ( (fd < 0) || (sys_fstat64(fd, &s) != 0) )
 			memset(&s, 0, sizeof(s));
 
 		add_code_region((char *)addr, PAGE_NEXT(length),
-		                s.st_ino, s.st_dev, s.st_mtime, pgoffset);
+		                s.st_ino, s.st_dev, s.st_mtime, pgoffset,
+		                !!(prot & PROT_WRITE));
 	}
 	else
 		del_code_region((char *)addr, PAGE_NEXT(length));
@@ -104,7 +106,8 @@ static void shadow_mremap(unsigned long old_addr, size_t old_size,
                           size_t new_size, long _flags, unsigned long new_addr)
 {
 	long flags = (old_addr != new_addr) ? MREMAP_MAYMOVE|MREMAP_FIXED : 0;
-	int is_code = !!find_code_map((char *)old_addr);
+	code_map_t *map = find_code_map((char *)old_addr);
+	int is_code = !!map, writable = map && map->writable;
 
 	if (new_addr < old_addr)
 		shadow_munmap(new_addr, min(old_addr-new_addr, new_size));
@@ -135,7 +138,7 @@ static void shadow_mremap(unsigned long old_addr, size_t old_size,
 			die("shadow_mremap(): %08x\n", ret);
 
 		if (is_code)
-			add_code_region((char *)new_addr, PAGE_NEXT(new_size), 0, 0, 0, 0);
+			add_code_region((char *)new_addr, PAGE_NEXT(new_size), 0, 0, 0, 0, writable);
 		else
 			del_code_region((char *)new_addr, PAGE_NEXT(new_size));
 	}
@@ -236,11 +239,6 @@ unsigned long user_mmap2(unsigned long addr, size_t length, int prot,
 	if ( !(ret & PG_MASK) )
 		shadow_mmap(ret, length, prot, fd, pgoffset);
 
-	if ( (prot & PROT_WRITE) && (prot & PROT_EXEC) )
-		debug("Minemu warning: RWX memory map: "
-		      "mmap(%08x, %u, %08x, %08x, %d, %u) = %08x",
-		      addr, length, prot, flags, fd, pgoffset, ret);
-
 	return ret;
 }
 
@@ -267,8 +265,9 @@ unsigned long user_mprotect(unsigned long addr, size_t length, long prot)
 
 	if ( !(ret & PG_MASK) )
 	{
-		if ( (prot & PROT_EXEC) && !(prot & PROT_WRITE) )
-			add_code_region((char *)addr, PAGE_NEXT(length), 0, 0, 0, 0);
+		if (prot & PROT_EXEC)
+			add_code_region((char *)addr, PAGE_NEXT(length), 0, 0, 0, 0,
+			                !!(prot & PROT_WRITE));
 		else
 			del_code_region((char *)addr, PAGE_NEXT(length));
 	}
@@ -316,24 +315,74 @@ unsigned long user_mremap(unsigned long old_addr, size_t old_size,
 	return ret;
 }
 
-static void copy_vdso(unsigned long addr, unsigned long orig)
+static void copy_vdso(unsigned long orig)
 {
-	vdso = addr; vdso_orig = orig;
+	vdso_size = vdso_image_size(orig);
+	vdso = USER_END-USER_STACK_SIZE-vdso_size; vdso_orig = orig;
 
-	long ret = user_mmap2(addr, 0x1000, PROT_READ|PROT_WRITE,
+	long ret = user_mmap2(vdso, vdso_size, PROT_READ|PROT_WRITE,
 	                      MAP_PRIVATE|MAP_FIXED|MAP_ANONYMOUS, -1, 0);
 
 	if (ret & PG_MASK)
 		die("connot alloc vdso", ret);
 
-	memcpy((char *)vdso, (char *)vdso_orig, 0x1000);
+	memcpy((char *)vdso, (char *)vdso_orig, vdso_size);
 
-	long off = memscan((char *)vdso, 0x1000, "\x5d\x5a\x59\xc3", 4);
+	long off = memscan((char *)vdso, vdso_size, "\x5d\x5a\x59\xc3", 4);
 
 	if (off < 0)
 		sysenter_reentry = 0; /* assume int $0x80 syscalls, crash otherwise */
 	else
 		sysenter_reentry = vdso + off;
+
+	init_vdso_calls(vdso, vdso_orig);
+}
+
+static unsigned long vvar_size = VVAR_DEFAULT_SIZE;
+
+/* The host's [vvar] mappings sit right below its vDSO, newer kernels
+ * split them up into [vvar] and [vvar_vclock].
+ */
+static void find_host_vvar(void)
+{
+	map_file_t f;
+	map_entry_t e;
+	char path[16];
+	unsigned long start = vdso_orig;
+
+	if ( (vdso_orig == 0) || (try_open_maps(&f) < 0) )
+		return;
+
+	while (read_map_path(&f, &e, path, sizeof(path)))
+		if ( (strncmp(path, "[vvar", 5) == 0) &&
+		     (e.addr < start) && (e.addr+e.len <= vdso_orig) )
+			start = e.addr;
+
+	close_maps(&f);
+
+	vvar_size = vdso_orig-start;
+}
+
+/* pre-allocate [start, end), but leave the host's [vvar] and [vdso]
+ * mappings alone, the time calls in vdso.c use them.
+ */
+static long prealloc_rw(unsigned long start, unsigned long end)
+{
+	unsigned long hole_start = vdso_orig-vvar_size,
+	              hole_end = vdso_orig+vdso_size;
+	long ret = 0;
+
+	if ( (vdso_orig == 0) || (hole_end <= start) || (hole_start >= end) )
+		return sys_mmap2(start, end-start, PROT_READ|PROT_WRITE,
+		                 MAP_PRIVATE|MAP_FIXED|MAP_ANONYMOUS, -1, 0);
+
+	if (hole_start > start)
+		ret |= prealloc_rw(start, hole_start);
+
+	if (hole_end < end)
+		ret |= prealloc_rw(hole_end, end);
+
+	return ret;
 }
 
 unsigned long get_stack_top(long auxv[], char *envp[])
@@ -366,7 +415,8 @@ void init_minemu_mem(long auxv[], char *envp[])
 	fill_last_page_hack();
 	mutex_init(&map_lock);
 
-	copy_vdso(USER_END-USER_STACK_SIZE-0x1000, get_aux(auxv, AT_SYSINFO_EHDR));
+	copy_vdso(get_aux(auxv, AT_SYSINFO_EHDR));
+	find_host_vvar();
 
 	/* pre-allocate some memory regions, mostly because this way we don't
 	 * have to do our own memory-allocation. It /is/ the reason we need
@@ -381,26 +431,19 @@ void init_minemu_mem(long auxv[], char *envp[])
 	                 SHADOW_DEFAULT_PROT, MAP_PRIVATE|MAP_FIXED|MAP_ANONYMOUS,
 	                 -1, 0);
 
-	user_mprotect(vdso, 0x1000, PROT_READ|PROT_EXEC);
+	user_mprotect(vdso, vdso_size, PROT_READ|PROT_EXEC);
 
 	ret |= sys_mmap2(JIT_START, JIT_SIZE,
 	                 PROT_NONE, MAP_PRIVATE|MAP_FIXED|MAP_ANONYMOUS,
 	                 -1, 0);
 
-	ret |= sys_mmap2(MINEMU_END, PAGE_BASE(c-0x1000)-MINEMU_END,
-	                 PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_FIXED|MAP_ANONYMOUS,
-	                 -1, 0);
-
-	ret |= sys_mmap2(MINEMU_END, 0x1000,
-	                 PROT_NONE, MAP_PRIVATE|MAP_FIXED|MAP_ANONYMOUS,
-	                 -1, 0);
+	/* [MINEMU_END, FD_TABLE_END+PG_SIZE) is set up by init_threads() */
+	ret |= prealloc_rw(FD_TABLE_END+PG_SIZE, PAGE_BASE(c-0x1000));
 
 	fill_last_page_hack();
 
 	if ( high_user_addr(stack_top) > stack_top )
-		ret |= sys_mmap2(stack_top, high_user_addr(stack_top)-stack_top,
-		                 PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_FIXED|MAP_ANONYMOUS,
-		                 -1, 0);
+		ret |= prealloc_rw(stack_top, high_user_addr(stack_top));
 
 	if (ret & PG_MASK)
 		die("mem init failed", ret);
@@ -48,6 +48,17 @@
 extern char minemu_end[], minemu_code_start[], minemu_code_end[];
 #define MINEMU_END ((unsigned long)minemu_end)
 
+/* thread contexts are allocated on demand from here, after a guard page,
+ * the area ends at ctx_area_end (see init_threads()), the file descriptor
+ * table follows after a guard page, minemu's stack starts after another
+ * guard page and is at least MINEMU_STACK_MIN large
+ */
+#define CTX_AREA_START (MINEMU_END+PG_SIZE)
+#define CTX_AREA_MAX (0x10000000UL)
+#define FD_TABLE_START (ctx_area_end+PG_SIZE)
+#define FD_TABLE_END (FD_TABLE_START+FD_TABLE_MAX)
+#define MINEMU_STACK_MIN (0x1000000UL)
+
 /* taint offset */
 
 #define TAINT_OFFSET (TAINT_START-USER_START)
@@ -56,11 +67,12 @@ extern char minemu_end[], minemu_code_start[], minemu_code_end[];
 
 #define USER_STACK_PAGES (0x6000UL)
 #define USER_STACK_SIZE (USER_STACK_PAGES * PG_SIZE)
-#define VDSO_SIZE  (PG_SIZE)
+#define VDSO_MAX_SIZE (0x10*PG_SIZE)
+#define VVAR_DEFAULT_SIZE (0x4*PG_SIZE) /* when /proc/self/maps is unavailable */
 
 #include <sys/mman.h>
 
-extern unsigned long vdso, vdso_orig, sysenter_reentry, minemu_stack_bottom, stack_bottom;
+extern unsigned long vdso, vdso_orig, vdso_size, sysenter_reentry, minemu_stack_bottom, stack_bottom;
 
 void init_minemu_mem(long auxv[], char *envp[]);
 
@@ -28,8 +28,11 @@
 #include "taint.h"
 #include "sigwrap.h"
 #include "threads.h"
+#include "pretranslate.h"
+#include "stats.h"
 
 char *progname = NULL;
+int cache_gc = 0;
 
 static void load_sigset(char *sigset_buf)
 {
@@ -58,10 +61,17 @@ void usage(char *arg0)
 	"Options:\n"
 	"\n"
 	"  -cache DIR          Cache jit code in DIR.\n"
+	"  -cachesize SIZE     Limit the jit cache to SIZE bytes (K, M, G suffixes\n"
+	"                      allowed) by removing the least recently used files.\n"
+	"  -cachegc            Remove outdated, corrupt and orphaned temp files from\n"
+	"                      the jit cache and enforce -cachesize, then exit.\n"
+	"  -pretranslate       Translate the program and its libraries into the\n"
+	"                      jit cache, instead of running it. (needs -cache)\n"
 	"  -dump DIR           Dump taint info in DIR when a program gets\n"
 	"                      terminated because of a tainted jump.\n"
 	"  -exec EXECUTABLE    Use EXECUTABLE as executable filename, instead of\n"
 	"                      doing path resolution on command.\n"
+	"  -stats              Print internal counters when a program exits.\n"
 	"\n"
 	"  -dumponexit         Also dump taint info when a program exits normally\n"
 	"  -nodumponexit       Don't dump taint info when a program exits normally (default)\n"
@@ -113,10 +123,21 @@ char **parse_options(char **argv)
 
 		     if ( strcmp(*argv, "-cache") == 0 )
 			set_jit_cache_dir(*++argv);
+		else if ( strcmp(*argv, "-cachesize") == 0 )
+		{
+			if (set_jit_cache_size(*++argv) < 0)
+				usage(arg0);
+		}
+		else if ( strcmp(*argv, "-cachegc") == 0 )
+			cache_gc = 1;
+		else if ( strcmp(*argv, "-pretranslate") == 0 )
+			pretranslate = 1;
 		else if ( strcmp(*argv, "-dump") == 0 )
 			set_taint_dump_dir(*++argv);
 		else if ( strcmp(*argv, "-exec") == 0 )
 			progname = *++argv;
+		else if ( strcmp(*argv, "-stats") == 0 )
+			show_stats = 1;
 		else if ( strcmp(*argv, "-sigmask") == 0 )
 			load_sigset(*++argv);
 		else if ( strcmp(*argv, "-help") == 0 )
@@ -159,6 +180,10 @@ char **parse_options(char **argv)
 
 		argv++;
 	}
+
+	if (cache_gc) /* no command needed */
+		return argv;
+
 	usage(arg0);
 }
 
@@ -166,8 +191,10 @@ long option_args_count(void)
 {
 	return 2 + /* -exec ... */ 2 + /* -sigmask ... */
 	       (get_jit_cache_dir()                   ? 2 : 0) +
+	       (get_jit_cache_size()                  ? 2 : 0) +
 	       (get_taint_dump_dir()                  ? 2 : 0) +
 	       (dump_on_exit                          ? 1 : 0) +
+	       (show_stats                            ? 1 : 0) +
 	       (dump_all                              ? 1 : 0) +
 	       (call_strategy != PRESEED_ON_CALL      ? 1 : 0) +
 	       (taint_flag == TAINT_OFF               ? 1 : 0) +
@@ -180,6 +207,7 @@ char **option_args_setup(char **argv, char *filename, char *sigset_buf)
 {
 	char *taint_dump_dir = get_taint_dump_dir();
 	char *cache_dir = get_jit_cache_dir();
+	char *cache_size = get_jit_cache_size();
 
 	long i=0;
 
@@ -198,6 +226,12 @@ char **option_args_setup(char **argv, char *filename, char *sigset_buf)
 		argv[i+1] = cache_dir;
 		i += 2;
 	}
+	if (cache_size)
+	{
+		argv[i  ] = "-cachesize";
+		argv[i+1] = cache_size;
+		i += 2;
+	}
 	if (taint_dump_dir)
 	{
 		argv[i  ] = "-dump";
@@ -209,6 +243,11 @@ char **option_args_setup(char **argv, char *filename, char *sigset_buf)
 		argv[i] = "-notaint";
 		i++;
 	}
+	if ( show_stats )
+	{
+		argv[i] = "-stats";
+		i++;
+	}
 	if ( dump_on_exit )
 	{
 		argv[i] = "-dumponexit";
@@ -20,6 +20,7 @@
 #define OPTIONS_H
 
 extern char *progname;
+extern int cache_gc;
 
 void version(void);
 char **parse_options(char **argv);
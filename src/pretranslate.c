@@ -0,0 +1,310 @@
+
+/* This file is part of minemu
+ *
+ * Copyright 2010-2011 Erik Bosman <erik@minemu.org>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Ahead-of-time translation (-pretranslate)
+ *
+ * The program is run up to the entry point of the executable, at which
+ * point the dynamic linker has mapped all libraries at the addresses a
+ * normal run will use. Then every file backed code map is translated
+ * starting from all code addresses we can find in its ELF file:
+ * the entry point, function symbols, init/fini arrays, the start of
+ * executable sections and PLT entries. The result goes to the jit cache
+ * and minemu exits without running the program itself.
+ */
+
+#include <elf.h>
+#include <fcntl.h>
+#include <string.h>
+#include <linux/limits.h>
+
+#include "pretranslate.h"
+#include "jit.h"
+#include "jit_cache.h"
+#include "codemap.h"
+#include "proc.h"
+#include "lib.h"
+#include "mm.h"
+#include "syscalls.h"
+#include "error.h"
+#include "kernel_compat.h"
+
+#ifndef STT_GNU_IFUNC
+#define STT_GNU_IFUNC (10)
+#endif
+
+#define PLT_ENTRY_SIZE (16)
+#define ENTRY_BATCH (1024)
+#define READ_BATCH (64)
+#define MAX_JOBS (8)
+
+int pretranslate = 0;
+char *pretranslate_entry = NULL;
+
+static unsigned long min(unsigned long a, unsigned long b) { return a<b ? a:b; }
+
+typedef struct
+{
+	code_map_t *map;
+	unsigned long base, n;
+	char *entries[ENTRY_BATCH];
+
+} entry_list_t;
+
+static void flush_entries(entry_list_t *l)
+{
+	jit_translate_entries(l->map, l->entries, l->n);
+	l->n = 0;
+}
+
+static void add_entry(entry_list_t *l, unsigned long vaddr)
+{
+	l->entries[l->n++] = (char *)(l->base + vaddr);
+
+	if (l->n == ENTRY_BATCH)
+		flush_entries(l);
+}
+
+static void add_symbols(entry_list_t *l, int fd, Elf32_Shdr *sh)
+{
+	Elf32_Sym sym[READ_BATCH];
+	unsigned long i, n, off, type;
+
+	for (off=0; off+sizeof(*sym) <= sh->sh_size; off+=n*sizeof(*sym))
+	{
+		n = min(READ_BATCH, (sh->sh_size-off)/sizeof(*sym));
+
+		if ( read_at(fd, sh->sh_offset+off, sym, n*sizeof(*sym)) != (long)(n*sizeof(*sym)) )
+			return;
+
+		for (i=0; i<n; i++)
+		{
+			type = ELF32_ST_TYPE(sym[i].st_info);
+
+			if ( ((type == STT_FUNC) || (type == STT_GNU_IFUNC)) &&
+			     (sym[i].st_shndx != SHN_UNDEF) )
+				add_entry(l, sym[i].st_value);
+		}
+	}
+}
+
+/* init/fini arrays hold link-time addresses, (REL relocations keep
+ * the addend in place)
+ */
+static void add_array(entry_list_t *l, int fd, Elf32_Shdr *sh)
+{
+	Elf32_Addr a[READ_BATCH];
+	unsigned long i, n, off;
+
+	for (off=0; off+sizeof(*a) <= sh->sh_size; off+=n*sizeof(*a))
+	{
+		n = min(READ_BATCH, (sh->sh_size-off)/sizeof(*a));
+
+		if ( read_at(fd, sh->sh_offset+off, a, n*sizeof(*a)) != (long)(n*sizeof(*a)) )
+			return;
+
+		for (i=0; i<n; i++)
+			add_entry(l, a[i]);
+	}
+}
+
+static void add_section(entry_list_t *l, int fd, Elf32_Shdr *sh, char *name)
+{
+	unsigned long off;
+
+	switch (sh->sh_type)
+	{
+		case SHT_SYMTAB:
+		case SHT_DYNSYM:
+			add_symbols(l, fd, sh);
+			break;
+		case SHT_INIT_ARRAY:
+		case SHT_FINI_ARRAY:
+		case SHT_PREINIT_ARRAY:
+			add_array(l, fd, sh);
+			break;
+		case SHT_PROGBITS:
+			if ( !(sh->sh_flags & SHF_EXECINSTR) )
+				break;
+
+			add_entry(l, sh->sh_addr);
+
+			if ( strncmp(name, ".plt", 4) == 0 )
+				for (off=0; off<sh->sh_size; off+=PLT_ENTRY_SIZE)
+					add_entry(l, sh->sh_addr+off);
+			break;
+		default:
+			break;
+	}
+}
+
+/* load bias of the object, from the segment mapped by map */
+static int get_load_base(int fd, Elf32_Ehdr *hdr, code_map_t *map, unsigned long *base)
+{
+	Elf32_Phdr p;
+	unsigned long i, map_off = map->pgoffset*PG_SIZE;
+
+	for (i=0; i<hdr->e_phnum; i++)
+	{
+		if ( read_at(fd, hdr->e_phoff+i*sizeof(p), &p, sizeof(p)) != sizeof(p) )
+			return -1;
+
+		if ( (p.p_type == PT_LOAD) &&
+		     (PAGE_BASE(p.p_offset) <= map_off) &&
+		     (p.p_offset+p.p_filesz > map_off) )
+		{
+			*base = (unsigned long)map->addr - map_off + p.p_offset - p.p_vaddr;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+static int pretranslate_map(code_map_t *map, char *path)
+{
+	struct kernel_stat64 s;
+	Elf32_Ehdr hdr;
+	Elf32_Shdr sh, strtab = { .sh_type = SHT_NULL };
+	entry_list_t l = { .map = map, .n = 0 };
+	unsigned long i, jit_len = map->jit_len;
+	char name[8];
+
+	int fd = sys_open(path, O_RDONLY, 0);
+	if (fd < 0)
+		return fd;
+
+	if ( (sys_fstat64(fd, &s) < 0) ||
+	     (s.st_ino != map->inode) || (s.st_dev != map->dev) ||
+	     (read_at(fd, 0, &hdr, sizeof(hdr)) != sizeof(hdr)) ||
+	     (memcmp(hdr.e_ident, ELFMAG, SELFMAG) != 0) ||
+	     (hdr.e_ident[EI_CLASS] != ELFCLASS32) ||
+	     (hdr.e_phentsize != sizeof(Elf32_Phdr)) ||
+	     (hdr.e_shnum && (hdr.e_shentsize != sizeof(Elf32_Shdr))) ||
+	     (get_load_base(fd, &hdr, map, &l.base) < 0) )
+	{
+		sys_close(fd);
+		return -1;
+	}
+
+	if (hdr.e_entry)
+		add_entry(&l, hdr.e_entry);
+
+	if ( (hdr.e_shstrndx != SHN_UNDEF) && (hdr.e_shstrndx < hdr.e_shnum) )
+		read_at(fd, hdr.e_shoff+hdr.e_shstrndx*sizeof(sh), &strtab, sizeof(strtab));
+
+	for (i=0; i<hdr.e_shnum; i++)
+	{
+		if ( read_at(fd, hdr.e_shoff+i*sizeof(sh), &sh, sizeof(sh)) != sizeof(sh) )
+			break;
+
+		memset(name, 0, sizeof(name));
+		if (strtab.sh_type == SHT_STRTAB)
+			read_at(fd, strtab.sh_offset+sh.sh_name, name, sizeof(name)-1);
+
+		add_section(&l, fd, &sh, name);
+	}
+
+	flush_entries(&l);
+	sys_close(fd);
+
+	if (map->jit_len == jit_len)
+		return 0;
+
+	return try_save_jit_cache(map);
+}
+
+static long wait_job(void)
+{
+	long status;
+
+	if ( (sys_waitpid(-1, &status, 0) < 0) || (status != 0) )
+		return 1;
+
+	return 0;
+}
+
+/* Called from jit() when the executable's entry point is reached */
+void pretranslate_all(void)
+{
+	map_file_t f;
+	map_entry_t e;
+	code_map_t *map;
+	char path[PATH_MAX+1];
+	unsigned long addr;
+	long jobs = 0, failed = 0, pid;
+
+	/* First give every map its jit memory. Maps which have not run yet
+	 * are allocated in address order, which matches a normal run only if
+	 * that run also calls into them in that order. Otherwise the cache
+	 * entries for those maps will simply not be found.
+	 */
+	open_maps(&f);
+	while (read_map(&f, &e))
+		for (addr=e.addr; addr<e.addr+e.len; addr=(unsigned long)map->addr+map->len)
+		{
+			if ( !(map = find_code_map((char *)addr)) )
+				break;
+
+			if ( map->inode && !map->jit_addr )
+				jit_map_alloc(map);
+		}
+	close_maps(&f);
+
+	/* maps are independent once they have their jit memory, translate
+	 * them in parallel
+	 */
+	open_maps(&f);
+	while (read_map_path(&f, &e, path, sizeof(path)))
+		for (addr=e.addr; addr<e.addr+e.len; addr=(unsigned long)map->addr+map->len)
+		{
+			if ( !(map = find_code_map((char *)addr)) )
+				break;
+
+			if ( !map->inode || !map->jit_addr || !path[0] )
+				continue;
+
+			if (jobs == MAX_JOBS)
+			{
+				failed += wait_job();
+				jobs--;
+			}
+
+			pid = sys_fork();
+
+			if (pid == 0)
+			{
+				if (pretranslate_map(map, path) < 0)
+				{
+					debug("pretranslate: failed to translate %s", path);
+					sys_exit_group(1);
+				}
+				sys_exit_group(0);
+			}
+
+			if (pid < 0)
+				failed += pretranslate_map(map, path) < 0 ? 1 : 0;
+			else
+				jobs++;
+		}
+	close_maps(&f);
+
+	while (jobs--)
+		failed += wait_job();
+
+	sys_exit_group(failed ? 1 : 0);
+}
@@ -78,21 +78,27 @@ static int map_eof(map_file_t *f)
 	if (f->i == f->n_read)
 	{
 		f->n_read = sys_read(f->fd, f->buf, sizeof(f->buf));
-		f->i = (f->n_read >= 0) ? 0 : -1;
+		f->i = (f->n_read > 0) ? 0 : -1;
 	}
 	return f->i == -1;
 }
 
 static int map_getc(map_file_t *f)
 {
-	return (!map_eof(f)) ? f->buf[f->i++] : -1;
+	return (!map_eof(f)) ? (unsigned char)f->buf[f->i++] : -1;
 }
 
-int open_maps(map_file_t *f)
+/* returns a negative error if /proc is not available */
+int try_open_maps(map_file_t *f)
 {
 	*f = (map_file_t) { .fd = sys_open("/proc/self/maps", O_RDONLY, 0), };
 
-	if (f->fd < 0)
+	return f->fd;
+}
+
+int open_maps(map_file_t *f)
+{
+	if (try_open_maps(f) < 0)
 		die("could not open /proc/self/maps");
 
 	return f->fd;
@@ -121,9 +127,15 @@ static unsigned long read_addr(map_file_t *f)
 	return addr;
 }
 
-int read_map(map_file_t *f, map_entry_t *e)
+/* path (size bytes) receives the mapped file's path, the name of a special
+ * mapping like [vvar], or an empty string for anonymous mappings, it may
+ * be NULL
+ */
+int read_map_path(map_file_t *f, map_entry_t *e, char *path, unsigned long size)
 {
 	int c;
+	unsigned long n = 0;
+
 	if (map_eof(f))
 		return 0;
 
@@ -136,8 +148,19 @@ int read_map(map_file_t *f, map_entry_t *e)
 	if (map_getc(f) == 'w') e->prot |= PROT_WRITE;
 	if (map_getc(f) == 'x') e->prot |= PROT_EXEC;
 
-	while ( (c=map_getc(f) != '\n') && (c > 0) );
+	/* offset, device and inode do not contain slashes or brackets */
+	while ( ((c=map_getc(f)) != '\n') && (c >= 0) )
+		if ( path && (n < size-1) && (n || (c == '/') || (c == '[')) )
+			path[n++] = c;
+
+	if (path)
+		path[n] = '\0';
 
 	return 1;
 }
 
+int read_map(map_file_t *f, map_entry_t *e)
+{
+	return read_map_path(f, e, NULL, 0);
+}
+
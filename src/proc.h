@@ -37,8 +37,10 @@ typedef struct
 
 } map_entry_t;
 
+int try_open_maps(map_file_t *f);
 int open_maps(map_file_t *f);
 int read_map(map_file_t *f, map_entry_t *e);
+int read_map_path(map_file_t *f, map_entry_t *e, char *path, unsigned long size);
 int close_maps(map_file_t *f);
 
 #endif /* PROC_H */
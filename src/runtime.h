@@ -23,6 +23,7 @@ void emu_start(void *eip, long *esp);
 void state_restore(void);
 
 void hook_stub(void);
+void vdso_stub(void);
 
 long runtime_ijmp(void);
 long runtime_ret_cleanup(void);
@@ -37,6 +38,8 @@ long int80_emu(void);
 long linux_sysenter_emu(void);
 long cpuid_emu(void);
 
+extern char int80_fast_syscall[], int80_fast_skip_entry[], int80_fast_skip[];
+
 extern char syscall_intr_critical_start[], syscall_intr_critical_end[],
             runtime_cache_resolution_start[], runtime_cache_resolution_end[],
             reloc_runtime_cache_resolution_start[], reloc_runtime_cache_resolution_end[];
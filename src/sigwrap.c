@@ -36,6 +36,8 @@
 #include "taint.h"
 #include "taint_dump.h"
 #include "threads.h"
+#include "codemap.h"
+#include "stats.h"
 
 /*
  * wrapper around signals, preventing signals being delivered on the
@@ -56,16 +58,6 @@ int try_block_signals(void)
 	                     sizeof(kernel_sigset_t),0,0);
 }
 
-int block_signals(void)
-{
-	kernel_sigset_t blockall;
-	memset(&blockall, 0xff, sizeof(blockall));
-	return syscall4(__NR_rt_sigprocmask, SIG_BLOCK,
-	                     (long)&blockall,
-	                     (long)&get_thread_ctx()->old_sigset,
-	                     sizeof(kernel_sigset_t));
-}
-
 void unblock_signals(void)
 {
 	syscall_intr(__NR_rt_sigprocmask, SIG_SETMASK,
@@ -74,6 +66,61 @@ void unblock_signals(void)
 	             sizeof(kernel_sigset_t),0,0);
 }
 
+#define barrier() __asm__ __volatile__ ("" ::: "memory")
+
+/* Cheaper than blocking signals for the emulation of calls which return
+ * normally. Asynchronous signals arriving while sigdefer is set are
+ * re-queued and kept blocked by sigwrap_handler(), undefer_signals()
+ * lets them through.
+ */
+int try_defer_signals(void)
+{
+	thread_ctx_t *local_ctx = get_thread_ctx();
+
+	local_ctx->sigdefer = 1;
+	barrier();
+
+	if (local_ctx->jit_fragment_running)
+	{
+		/* we have a signal in progress, same as syscall_intr() */
+		local_ctx->sigdefer = 0;
+		local_ctx->jit_fragment_restartsys = 1;
+		return 0;
+	}
+
+	return 1;
+}
+
+void defer_signals(void)
+{
+	get_thread_ctx()->sigdefer = 1;
+	barrier();
+}
+
+void undefer_signals(void)
+{
+	thread_ctx_t *local_ctx = get_thread_ctx();
+
+	barrier();
+	local_ctx->sigdefer = 0;
+	barrier();
+
+	/* the deferred signals get delivered from the syscall, sigwrap_handler()
+	 * sees sigdefer_pending and fixes up the mask in its frame
+	 */
+	if (local_ctx->sigdefer_pending)
+	{
+		sys_rt_sigprocmask(SIG_SETMASK, &local_ctx->sigdefer_mask, NULL, sizeof(kernel_sigset_t));
+		local_ctx->sigdefer_pending = 0;
+	}
+}
+
+static int sync_signal(int sig)
+{
+	return (sig == SIGSEGV) || (sig == SIGBUS) || (sig == SIGILL) ||
+	       (sig == SIGFPE)  || (sig == SIGTRAP);
+}
+
 #ifndef SA_RESTORER
 #define SA_RESTORER        (0x04000000)
 #endif
@@ -150,6 +197,10 @@ static void *copy_frame_to_user(void *frame, struct kernel_sigaction *action,
 
 	void *copy = get_sigframe_addr(action, context, size);
 
+	/* with all signals blocked, a write fault would kill us */
+	if (copy != (void *)-1L)
+		unprotect_code_range(copy, size);
+
 	memcpy(copy, frame, size);
 	taint_mem(copy, size, TAINT_CLEAR);
 	return copy;
@@ -161,7 +212,7 @@ static struct kernel_rt_sigframe *copy_rt_sigframe_to_user(struct kernel_rt_sigf
 	struct kernel_rt_sigframe *copy = copy_frame_to_user(frame, action, &frame->uc.uc_mcontext);
 	rt_sigframe_patch_pointers(copy, frame);
 
-	if (contains((char *)vdso_orig, 0x1000, copy->pretcode))
+	if (contains((char *)vdso_orig, vdso_size, copy->pretcode))
 		copy->pretcode += vdso - vdso_orig;
 
 	if (action->flags & SA_RESTORER)
@@ -176,7 +227,7 @@ static struct kernel_sigframe *copy_sigframe_to_user(struct kernel_sigframe *fra
 	struct kernel_sigframe *copy = copy_frame_to_user(frame, action, &frame->sc);
 	sigframe_patch_pointers(copy, frame);
 
-	if (contains((char *)vdso_orig, 0x1000, copy->pretcode))
+	if (contains((char *)vdso_orig, vdso_size, copy->pretcode))
 		copy->pretcode += vdso - vdso_orig;
 
 	if (action->flags & SA_RESTORER)
@@ -211,6 +262,177 @@ static void dump_on_error(int sig, struct sigcontext *context)
 	}
 }
 
+/* Pages of writable code are write-protected once we have translated code
+ * from them. On a write, we throw away the translations for the page and
+ * let the write go through. Returns 1 if the fault was handled this way.
+ */
+static int code_write_fault(int sig, struct sigcontext *context)
+{
+	thread_ctx_t *local_ctx = get_thread_ctx();
+	char *addr = (char *)context->cr2;
+
+	if ( (sig != SIGSEGV) || (context->trapno != 14) || !(context->err & 2) ||
+	     !unprotect_code_page(addr) )
+		return 0;
+
+	stats.code_write_faults++;
+
+	/* common case, retry the write */
+	if (trylock_jit())
+	{
+		int ret = invalidate_code_page(addr);
+		unlock_jit();
+
+		if (ret == 0)
+			return 1;
+	}
+
+	/* minemu itself wrote the page while holding jit_lock, the
+	 * invalidation happens in unlock_jit()
+	 */
+	else if (jit_lock_held())
+	{
+		jit_defer_invalidate(addr);
+		return 1;
+	}
+
+	/* We may not wait for jit_lock while inside jit code which may be
+	 * thrown away in the meantime. Finish the instruction first and
+	 * continue through the runtime.
+	 */
+	if ( contains((char *)JIT_START, JIT_SIZE, (char *)context->eip) )
+	{
+		local_ctx->user_eip = (long)finish_instruction(context);
+		context->ds =
+		context->es =
+		context->ss = shield_segment;
+		context->cs = code_segment;
+		context->eip = (long)state_restore;
+	}
+
+	quiesce_enter();
+	lock_jit();
+	quiesce_exit();
+
+	if (invalidate_code_page(addr) < 0)
+		jit_flush();
+
+	unlock_jit();
+
+	return 1;
+}
+
+/* Page faults (garbage collectors, user space paging) usually come from
+ * the original instruction, which we copy verbatim at the end of its
+ * translation, after the taint code. Nothing has retired yet, so the
+ * original address is the signal address and no jit fragment is needed.
+ * Returns NULL if we need to take the long way.
+ */
+static char *fast_fault_eip(int sig, struct sigcontext *context)
+{
+	char *eip = (char *)context->eip, *orig_eip, *jit_op_start;
+	long jit_op_len, tail;
+
+	if ( ((sig != SIGSEGV) && (sig != SIGBUS)) || get_taint_dump_dir() ||
+	     !contains((char *)JIT_START, JIT_SIZE, eip) )
+		return NULL;
+
+	orig_eip = jit_rev_lookup_addr(eip, &jit_op_start, &jit_op_len);
+
+	if ( !orig_eip || (eip == jit_op_start) )
+		return orig_eip;
+
+	tail = jit_op_start + jit_op_len - eip;
+
+	if ( (tail > 0) && (op_size(orig_eip, tail) == tail) &&
+	     (memcmp(eip, orig_eip, tail) == 0) )
+		return orig_eip;
+
+	return NULL;
+}
+
+static void sigwrap_handler(int sig, siginfo_t *info, void *_);
+
+static int default_action(const struct kernel_sigaction *act)
+{
+	return (act->handler == KERNEL_SIG_DFL) || (act->handler == KERNEL_SIG_IGN);
+}
+
+/* SIGSEGV is caught for code_write_fault() even if the program does not
+ * handle it, with siginfo to tell real faults from sent signals
+ */
+static int caught_default(int sig, const struct kernel_sigaction *act)
+{
+	return (sig == SIGSEGV) && default_action(act);
+}
+
+static void wrap_sigaction(int sig, const struct kernel_sigaction *act,
+                           struct kernel_sigaction *wrap)
+{
+	*wrap = *act;
+
+	if ( ( act->handler != (kernel_sighandler_t)SIG_ERR &&
+	       act->handler != (kernel_sighandler_t)SIG_DFL &&
+	       act->handler != (kernel_sighandler_t)SIG_IGN ) || (sig == SIGSEGV) )
+		wrap->handler = sigwrap_handler;
+
+	/* SA_RESETHAND is emulated by sigwrap_handler(), SIGSEGV must stay
+	 * caught for code_write_fault()
+	 */
+	if (caught_default(sig, act))
+		wrap->flags |= SA_SIGINFO;
+
+	wrap->flags |= SA_ONSTACK;
+	wrap->flags &=~ ( SA_NODEFER | SA_RESTORER | SA_ONESHOT );
+	memset(&wrap->mask, 0xff, sizeof(wrap->mask));
+}
+
+/* put the signal back in the queue, blocked until undefer_signals() */
+static void defer_signal(int sig, siginfo_t *info, int rt,
+                         unsigned long *sigmask, unsigned long *extramask)
+{
+	thread_ctx_t *local_ctx = get_thread_ctx();
+
+	if (!local_ctx->sigdefer_pending)
+	{
+		local_ctx->sigdefer_mask.bitmask[0] = *sigmask;
+		local_ctx->sigdefer_mask.bitmask[1] = *extramask;
+		local_ctx->sigdefer_pending = 1;
+	}
+
+	if (sig <= 32)
+		*sigmask |= 1UL << (sig-1);
+	else
+		*extramask |= 1UL << (sig-33);
+
+	/* only the main thread may queue kernel generated siginfo to itself,
+	 * other threads keep it until the plain signal they send comes back
+	 */
+	if ( rt && (sys_rt_tgsigqueueinfo(sys_getpid(), sys_gettid(), sig, info) == 0) )
+		return;
+
+	if ( rt && (sig <= 32) && (info->si_code >= 0) )
+	{
+		local_ctx->sigdefer_info.info[sig-1] = *info;
+		local_ctx->sigdefer_info.saved |= 1UL << (sig-1);
+	}
+
+	sys_tgkill(sys_getpid(), sys_gettid(), sig);
+}
+
+/* puts back the siginfo of a signal re-sent by defer_signal() */
+static void restore_deferred_info(int sig, siginfo_t *info)
+{
+	sigdefer_info_t *d = &get_thread_ctx()->sigdefer_info;
+
+	if ( (sig > 32) || !(d->saved & (1UL << (sig-1))) ||
+	     (info->si_code != SI_TKILL) || (info->si_pid != sys_getpid()) )
+		return;
+
+	*info = d->info[sig-1];
+	d->saved &= ~(1UL << (sig-1));
+}
+
 static void sigwrap_handler(int sig, siginfo_t *info, void *_)
 {
 	thread_ctx_t *local_ctx = get_thread_ctx();
@@ -218,32 +440,100 @@ static void sigwrap_handler(int sig, siginfo_t *info, void *_)
 	struct kernel_rt_sigframe *rt_sigframe = (struct kernel_rt_sigframe *) return_stackp;
 	struct kernel_sigframe    *sigframe    = (struct kernel_sigframe *)    return_stackp;
 	struct sigcontext *context;
+	struct kernel_sigaction wrap;
 	unsigned long *sigmask, *extramask;
+	int defer = local_ctx->sigdefer && !sync_signal(sig);
 
 	siglock(local_ctx);
 	struct kernel_sigaction action = local_ctx->sighandler->sigaction_list[sig];
-	if ( action.flags & SA_ONESHOT )
-		memset(&local_ctx->sighandler->sigaction_list[sig], 0, sizeof(struct kernel_sigaction));
-
 	sigunlock(local_ctx);
 
 	if ( (sig < 0) || (sig >= KERNEL_NSIG) )
 		die("bad signo. %d", sig);
 
-	if ( action.flags & SA_SIGINFO )
+	/* the frame the kernel gave us */
+	int rt = (action.flags & SA_SIGINFO) || caught_default(sig, &action);
+
+	if ( rt )
+	{
 		context = &rt_sigframe->uc.uc_mcontext;
+		sigmask = &rt_sigframe->uc.uc_sigmask.bitmask[0];
+		extramask = &rt_sigframe->uc.uc_sigmask.bitmask[1];
+	}
 	else
+	{
 		context = &sigframe->sc;
+		sigmask = &sigframe->sc.oldmask;
+		extramask = &sigframe->extramask[0];
+	}
+
+	if (defer)
+	{
+		defer_signal(sig, info, rt, sigmask, extramask);
+		return;
+	}
+
+	if (rt)
+		restore_deferred_info(sig, info);
 
-	dump_on_error(sig, context);
+	if (code_write_fault(sig, context))
+		return;
+
+	/* SA_RESETHAND, only now that we know the signal is for the user */
+	if ( action.flags & SA_ONESHOT )
+	{
+		siglock(local_ctx);
+		struct kernel_sigaction *cur = &local_ctx->sighandler->sigaction_list[sig];
+
+		if (cur->handler == action.handler)
+		{
+			memset(cur, 0, sizeof(struct kernel_sigaction));
+			wrap_sigaction(sig, cur, &wrap);
+			sys_rt_sigaction(sig, &wrap, NULL, sizeof(kernel_sigset_t));
+		}
+		else /* another thread took it first */
+			action.handler = cur->handler;
+
+		sigunlock(local_ctx);
+	}
+
+	/* we interrupted undefer_signals(), unblock the deferred signals */
+	if (local_ctx->sigdefer_pending)
+	{
+		local_ctx->sigdefer_pending = 0;
+		*sigmask = local_ctx->sigdefer_mask.bitmask[0];
+		*extramask = local_ctx->sigdefer_mask.bitmask[1];
+	}
+
+	/* sent rather than caused by a fault, nothing to do */
+	if ( (action.handler == KERNEL_SIG_IGN) && (info->si_code <= 0) )
+		return;
+
+	char *orig_eip = fast_fault_eip(sig, context);
+
+	if (orig_eip)
+		stats.fast_faults++;
+	else
+		dump_on_error(sig, context);
+
+	/* SIGSEGV is always caught for code_write_fault(), fall back to the
+	 * default action, faults can not be ignored
+	 */
+	if (default_action(&action))
+	{
+		struct kernel_sigaction dfl = { .handler = KERNEL_SIG_DFL };
+		sys_rt_sigaction(sig, &dfl, NULL, sizeof(kernel_sigset_t));
+		raise(sig);
+		return;
+	}
 
 	/* original code address */
-	context->eip = (long)finish_instruction(context);
+	context->eip = (long)(orig_eip ? orig_eip : finish_instruction(context));
 
 	/* Most evil hack ever! We 'deliver' the user's signal by modifying our own sigframe
 	 * to match the user process' state at signal delivery, and call sigreturn.
 	 */
-	if ( action.flags & SA_SIGINFO )
+	if ( rt )
 	{
 		sigmask = &rt_sigframe->uc.uc_sigmask.bitmask[0];
 		extramask = &rt_sigframe->uc.uc_sigmask.bitmask[1];
@@ -285,6 +575,9 @@ static void sigwrap_handler(int sig, siginfo_t *info, void *_)
 			*extramask |= 1UL << (sig-33);
 	}
 
+	/* we may have interrupted a syscall, which does not return normally */
+	quiesce_exit();
+
 	/* return into (rt_)sigreturn */
 }
 
@@ -299,6 +592,7 @@ void user_sigreturn(void)
 	
 	local_ctx->user_eip = context->eip;            /* jump into jit code, */
 	context->eip = (long)state_restore;            /* not user code       */
+	quiesce_exit();
 	load_sigframe(&frame);
 }
 
@@ -318,6 +612,7 @@ void user_rt_sigreturn(void)
 		.ss_flags = 0,
 		.ss_size = sizeof( local_ctx->sigwrap_stack )
 	};
+	quiesce_exit();
 	load_rt_sigframe(&frame);
 }
 
@@ -355,12 +650,13 @@ void sigwrap_init(void)
 	{
 		.handler = sigwrap_handler,
 		.flags = SA_ONSTACK,
-	};
+	}, wrap;
 
 	memset(&act.mask, 0xff, sizeof(act.mask));
+	wrap_sigaction(SIGSEGV, &get_thread_ctx()->sighandler->sigaction_list[SIGSEGV], &wrap);
+	sys_rt_sigaction(SIGSEGV, &wrap, NULL, sizeof(wrap.mask));
 	if (get_taint_dump_dir())
 	{
-		sys_rt_sigaction(SIGSEGV, &act, NULL, sizeof(act.mask));
 		sys_rt_sigaction(SIGILL, &act, NULL, sizeof(act.mask));
 		sys_rt_sigaction(SIGFPE, &act, NULL, sizeof(act.mask));
 	}
@@ -446,18 +742,7 @@ long user_rt_sigaction(int sig, const struct kernel_sigaction *act,
 
 	/* TODO: do -EFAULT magic on SIGSEGV */
 	if (act)
-	{
-		wrap = *act;
-
-		if ( act->handler != (kernel_sighandler_t)SIG_ERR &&
-		     act->handler != (kernel_sighandler_t)SIG_DFL &&
-		     act->handler != (kernel_sighandler_t)SIG_IGN )
-			wrap.handler = sigwrap_handler;
-
-		wrap.flags |= SA_ONSTACK;
-		wrap.flags &=~ ( SA_NODEFER | SA_RESTORER );
-		memset(&wrap.mask, 0xff, sizeof(wrap.mask));
-	}
+		wrap_sigaction(sig, act, &wrap);
 
 	siglock(local_ctx);
 	ret = sys_rt_sigaction(sig, act ? &wrap : NULL, NULL, sigsetsize);
@@ -25,8 +25,10 @@
 #include "kernel_compat.h"
 
 int try_block_signals(void);
-int block_signals(void);
 void unblock_signals(void);
+int try_defer_signals(void);
+void defer_signals(void);
+void undefer_signals(void);
 void altstack_setup(void);
 void sigwrap_init(void);
 void load_sigframe(struct kernel_sigframe *frame);
@@ -0,0 +1,52 @@
+
+/* This file is part of minemu
+ *
+ * Copyright 2010-2011 Erik Bosman <erik@minemu.org>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "stats.h"
+#include "lib.h"
+#include "syscalls.h"
+#include "threads.h"
+
+int show_stats = 0;
+stats_t stats;
+
+void print_stats(void)
+{
+	if (!show_stats)
+		return;
+
+	fd_printf(2, "minemu[%d] stats:\n", sys_getpid());
+	fd_printf(2, "  jit flushes:         %u\n", stats.jit_flushes);
+	fd_printf(2, "  jit flushed bytes:   %u\n", stats.jit_flushed_bytes);
+	fd_printf(2, "  deferred flushes:    %u\n", stats.jit_flushes_deferred);
+	fd_printf(2, "  jit compactions:     %u\n", stats.jit_compactions);
+	fd_printf(2, "  jit relocations:     %u\n", stats.jit_relocations);
+	fd_printf(2, "  jit mem allocs:      %u\n", stats.jit_mem_allocs);
+	fd_printf(2, "  jit mem frees:       %u\n", stats.jit_mem_frees);
+	fd_printf(2, "  jit mem failed:      %u\n", stats.jit_mem_failed);
+	fd_printf(2, "  jit mem peak:        %uK\n", stats.jit_mem_peak/1024);
+	fd_printf(2, "  jit mem leaked:      %u\n", stats.jit_mem_leaked);
+	fd_printf(2, "  chunks invalidated:  %u\n", stats.jit_chunks_invalidated);
+	fd_printf(2, "  maps discarded:      %u\n", stats.jit_maps_discarded);
+	fd_printf(2, "  code write faults:   %u\n", stats.code_write_faults);
+	fd_printf(2, "  fast faults:         %u\n", stats.fast_faults);
+	print_jmp_cache_stats();
+	print_thread_mem_stats();
+#ifdef MUTEX_STATS
+	print_mutex_stats();
+#endif
+}
@@ -0,0 +1,47 @@
+
+/* This file is part of minemu
+ *
+ * Copyright 2010-2011 Erik Bosman <erik@minemu.org>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+/* Internal counters, printed at exit with -stats */
+typedef struct
+{
+	unsigned long jit_flushes;        /* jit memory exhausted, all code dropped */
+	unsigned long jit_flushed_bytes;
+	unsigned long jit_flushes_deferred; /* memory not reset, some thread stayed in jit code */
+	unsigned long jit_compactions;    /* flushes because jit memory got fragmented */
+	unsigned long jit_relocations;    /* maps moved to a larger block */
+	unsigned long jit_mem_allocs;
+	unsigned long jit_mem_frees;
+	unsigned long jit_mem_failed;     /* no free region large enough */
+	unsigned long jit_mem_peak;       /* bytes */
+	unsigned long jit_mem_leaked;     /* blocks in use we could not queue for freeing */
+	unsigned long jit_chunks_invalidated; /* code made non-executable or unmapped */
+	unsigned long jit_maps_discarded;
+	unsigned long code_write_faults;      /* writes to write-protected code */
+	unsigned long fast_faults;            /* guest faults delivered without jit fragment */
+
+} stats_t;
+
+extern int show_stats;
+extern stats_t stats;
+
+void print_stats(void);
+
+#endif /* STATS_H */
@@ -20,6 +20,7 @@
 
 #include <linux/unistd.h>
 #include <string.h>
+#include <errno.h>
 #include <sched.h>
 
 #include "runtime.h"
@@ -33,61 +34,161 @@
 #include "debug.h"
 #include "taint_dump.h"
 #include "threads.h"
+#include "codemap.h"
+#include "stats.h"
+
+/* how syscall_emu() handles a call, calls missing from the table go
+ * straight to the kernel
+ */
+#define SYSCALL_TABLE_SIZE (512)
+
+enum
+{
+	SYSCALL_PASS = 0, /* no emulation needed */
+	SYSCALL_TAINT,    /* passed on, the result is tainted afterwards */
+	SYSCALL_EMU,      /* emulated, with signals blocked */
+	SYSCALL_MM,       /* emulated, with signals deferred */
+};
+
+static const char syscall_class[SYSCALL_TABLE_SIZE] =
+{
+	[__NR_brk]          = SYSCALL_MM,
+	[__NR_mmap2]        = SYSCALL_MM,
+	[__NR_mmap]         = SYSCALL_MM,
+	[__NR_mremap]       = SYSCALL_MM,
+	[__NR_mprotect]     = SYSCALL_MM,
+	[__NR_madvise]      = SYSCALL_MM,
+	[__NR_ipc]          = SYSCALL_MM,  /* only SHMAT */
+
+	[__NR_sigaltstack]  = SYSCALL_EMU,
+	[__NR_signal]       = SYSCALL_EMU,
+	[__NR_sigaction]    = SYSCALL_EMU,
+	[__NR_sigreturn]    = SYSCALL_EMU,
+	[__NR_rt_sigaction] = SYSCALL_EMU,
+	[__NR_rt_sigreturn] = SYSCALL_EMU,
+
+	[__NR_fork]         = SYSCALL_EMU,
+	[__NR_vfork]        = SYSCALL_EMU,
+	[__NR_clone]        = SYSCALL_EMU,
+	[__NR_exit]         = SYSCALL_EMU,
+
+	[__NR_execve]       = SYSCALL_EMU,
+	[__NR_exit_group]   = SYSCALL_EMU,
+
+	[__NR_read]         = SYSCALL_TAINT,
+	[__NR_readv]        = SYSCALL_TAINT,
+	[__NR_open]         = SYSCALL_TAINT,
+	[__NR_creat]        = SYSCALL_TAINT,
+	[__NR_dup]          = SYSCALL_TAINT,
+	[__NR_dup2]         = SYSCALL_TAINT,
+	[__NR_dup3]         = SYSCALL_TAINT,
+	[__NR_fcntl]        = SYSCALL_TAINT,  /* only F_DUPFD(_CLOEXEC) */
+	[__NR_fcntl64]      = SYSCALL_TAINT,
+	[__NR_close]        = SYSCALL_TAINT,
+	[__NR_openat]       = SYSCALL_TAINT,
+	[__NR_pipe]         = SYSCALL_TAINT,
+	[__NR_socketcall]   = SYSCALL_TAINT,
+	[__NR_accept4]      = SYSCALL_TAINT,
+};
+
+/* Calls int80_emu may issue directly from the user's context, indexed
+ * by the low 16 bits of the syscall number. Higher numbers are invalid
+ * and end up at the kernel either way.
+ */
+char syscall_fast[0x10000];
+
+void init_syscalls(void)
+{
+	long i;
+
+	for (i=0; i<SYSCALL_TABLE_SIZE; i++)
+		syscall_fast[i] = (syscall_class[i] == SYSCALL_PASS) ||
+		                  ( (syscall_class[i] == SYSCALL_TAINT) &&
+		                    (taint_flag != TAINT_ON) );
+
+	for (; i<(long)sizeof(syscall_fast); i++)
+		syscall_fast[i] = 1;
+}
+
+/* The kernel cannot write to writable code we have write-protected. We do
+ * not know which buffers a call writes to, so on -EFAULT all of it is made
+ * writable again and the call is retried. Calls which fail to copy out
+ * their results generally do so before they have had any effect.
+ */
+static long syscall_retry_efault(long call, long arg1, long arg2, long arg3,
+                                            long arg4, long arg5, long arg6)
+{
+	long ret = syscall_intr(call,arg1,arg2,arg3,arg4,arg5,arg6);
+
+	if ( (ret == -EFAULT) && unprotect_code_range((char *)USER_START, USER_END-USER_START) )
+		ret = syscall_intr(call,arg1,arg2,arg3,arg4,arg5,arg6);
+
+	return ret;
+}
 
 long syscall_emu(long call, long arg1, long arg2, long arg3,
                             long arg4, long arg5, long arg6)
 {
 	long ret;
-	switch (call)
-	{
- 		case __NR_brk:
- 		case __NR_mmap2:
- 		case __NR_mmap:
- 		case __NR_mremap:
- 		case __NR_mprotect:
- 		case __NR_madvise:
+	int class = SYSCALL_PASS;
 
- 		case __NR_sigaltstack:
- 		case __NR_signal:
- 		case __NR_sigaction:
-		case __NR_sigreturn:
- 		case __NR_rt_sigaction:
-		case __NR_rt_sigreturn:
+	if ( (unsigned long)call < SYSCALL_TABLE_SIZE )
+		class = syscall_class[call];
 
-		case __NR_fork:
-		case __NR_vfork:
-		case __NR_clone:
-		case __NR_exit:
+	if ( (call == __NR_ipc) && (arg1 != SHMAT) )
+		class = SYSCALL_PASS;
 
-		case __NR_execve:
-		case __NR_exit_group:
-			break;
+	if (class == SYSCALL_PASS)
+		return syscall_retry_efault(call,arg1,arg2,arg3,arg4,arg5,arg6);
+
+	if (class == SYSCALL_TAINT)
+	{
+		ret = syscall_retry_efault(call,arg1,arg2,arg3,arg4,arg5,arg6);
+
+		if ( taint_flag == TAINT_ON )
+			do_taint(ret,call,arg1,arg2,arg3,arg4,arg5,arg6);
 
-		case __NR_read:
-		case __NR_readv:
-		case __NR_open:
-		case __NR_creat:
-		case __NR_dup:
-		case __NR_dup2:
-		case __NR_openat:
-		case __NR_pipe:
-		case __NR_socketcall:
-			ret = syscall_intr(call,arg1,arg2,arg3,arg4,arg5,arg6);
+		return ret;
+	}
 
-			if ( taint_flag == TAINT_ON )
-				do_taint(ret,call,arg1,arg2,arg3,arg4,arg5,arg6);
+	ret = call;
 
-			return ret;
+	if (class == SYSCALL_MM)
+	{
+		if (!try_defer_signals())
+			return ret; /* we have a signal in progress, revert to pre-syscall state */
 
- 		case __NR_ipc:
-			if ( arg1 == SHMAT )
+		switch (call)
+		{
+			case __NR_brk:
+				ret = user_brk(arg1);
 				break;
-			/* fall through */
-		default:
-			return syscall_intr(call,arg1,arg2,arg3,arg4,arg5,arg6);
+			case __NR_mmap2:
+				ret = user_mmap2(arg1,arg2,arg3,arg4,arg5,arg6);
+				break;
+			case __NR_mmap:
+				ret = user_old_mmap((struct kernel_mmap_args *)arg1);
+				break;
+			case __NR_mremap:
+				ret = user_mremap(arg1,arg2,arg3,arg4,arg5);
+				break;
+			case __NR_mprotect:
+				ret = user_mprotect(arg1,arg2,arg3);
+				break;
+			case __NR_madvise:
+				ret = user_madvise(arg1,arg2,arg3);
+				break;
+			case __NR_ipc:
+				ret = user_shmat(arg2,(char *)arg5,arg3,(unsigned long *)arg4);
+				break;
+			default:
+				die("unimplemented syscall");
+				break;
+		}
+		undefer_signals();
+		return ret;
 	}
 
-	ret = call;
 	if (!try_block_signals())
 		return ret; /* we have a signal in progress, revert to pre-syscall state */
 
@@ -96,30 +197,6 @@ long syscall_emu(long call, long arg1, long arg2, long arg3,
 		/* these calls are all non-blocking right?
 		 * blocked signals during blocking calls is a bad thing
 		 */
- 		case __NR_brk:
-			ret = user_brk(arg1);
-			break;
- 		case __NR_mmap2:
-			ret = user_mmap2(arg1,arg2,arg3,arg4,arg5,arg6);
-			break;
- 		case __NR_mmap:
-			ret = user_old_mmap((struct kernel_mmap_args *)arg1);
-			break;
- 		case __NR_mremap:
-			ret = user_mremap(arg1,arg2,arg3,arg4,arg5);
-			break;
- 		case __NR_mprotect:
-			ret = user_mprotect(arg1,arg2,arg3);
-			break;
- 		case __NR_madvise:
-			ret = user_madvise(arg1,arg2,arg3);
-			break;
- 		case __NR_ipc:
-			if (arg1 == SHMAT)
-				ret = user_shmat(arg2,(char *)arg5,arg3,(unsigned long *)arg4);
-			else
-				die("should not have caught IPC call: %d", arg1);
-			break;
 
  		case __NR_sigaltstack:
 			ret = user_sigaltstack((stack_t *)arg1, (stack_t *)arg2);
@@ -167,6 +244,8 @@ long syscall_emu(long call, long arg1, long arg2, long arg3,
 				long regs[] = { call, arg2, arg3, arg1, get_thread_ctx()->user_esp, arg6, arg4, arg5 };
 				do_taint_dump(regs);
 			}
+			save_code_maps();
+			print_stats();
 			sys_exit_group(arg1);
 		default:
 			die("unimplemented syscall");
@@ -31,6 +31,8 @@ long syscall4(long no, long a0, long a1, long a2, long a3);
 long syscall5(long no, long a0, long a1, long a2, long a3, long a4);
 long syscall6(long no, long a0, long a1, long a2, long a3, long a4, long a5);
 
+void init_syscalls(void);
+
 long syscall_emu(long call, long arg1, long arg2, long arg3,
                             long arg4, long arg5, long arg6);
 
@@ -50,6 +52,9 @@ long syscall_intr(long call, long arg1, long arg2, long arg3,
 #define sys_madvise(a, b, c) \
 	syscall3(SYS_madvise, (long)(a), (long)(b), (long)(c))
 
+#define sys_mincore(a, b, c) \
+	syscall3(SYS_mincore, (long)(a), (long)(b), (long)(c))
+
 #define sys_mremap(a, b, c, d, e) \
 	syscall5(SYS_mremap, (long)(a), (long)(b), (long)(c), (long)(d), (long)e)
 
@@ -90,9 +95,18 @@ long syscall_intr(long call, long arg1, long arg2, long arg3,
 #define sys_gettid() \
 	syscall0(SYS_gettid)
 
+#define sys_getpid() \
+	syscall0(SYS_getpid)
+
 #define sys_tgkill(a, b, c) \
 	syscall3(SYS_tgkill, (long)(a), (long)(b), (long)(c))
 
+#define sys_rt_tgsigqueueinfo(a, b, c, d) \
+	syscall4(SYS_rt_tgsigqueueinfo, (long)(a), (long)(b), (long)(c), (long)(d))
+
+#define sys_rt_sigprocmask(how, set, oset, sigsetsize) \
+	syscall4(SYS_rt_sigprocmask, (long)(how), (long)(set), (long)(oset), (long)(sigsetsize))
+
 #define sys_set_thread_area(a) \
 	syscall1(SYS_set_thread_area, (long)(a))
 
@@ -132,6 +146,21 @@ long syscall_intr(long call, long arg1, long arg2, long arg3,
 #define sys_rename(oldpath, newpath) \
 	syscall2(SYS_rename, (long)oldpath, (long)newpath)
 
+#define sys_sched_yield() \
+	syscall0(SYS_sched_yield)
+
+#define sys_unlink(path) \
+	syscall1(SYS_unlink, (long)path)
+
+#define sys_getdents64(fd, dirp, count) \
+	syscall3(SYS_getdents64, (long)fd, (long)dirp, (long)count)
+
+#define sys_utimes(path, times) \
+	syscall2(SYS_utimes, (long)path, (long)times)
+
+#define sys_kill(pid, sig) \
+	syscall2(SYS_kill, (long)pid, (long)sig)
+
 #define sys_getcwd(buf, bufsize) \
 	syscall2(SYS_getcwd, (long)buf, (long)bufsize)
 
@@ -144,4 +173,7 @@ long syscall_intr(long call, long arg1, long arg2, long arg3,
 #define sys_readlink(a, b, c) \
 	syscall3(SYS_readlink, (long)(a), (long)(b), (long)(c))
 
+#define sys_getrlimit(resource, rlim) \
+	syscall2(SYS_ugetrlimit, (long)(resource), (long)(rlim))
+
 #endif /* SYSCALLS_H */
@@ -22,6 +22,7 @@
 #include <linux/limits.h>
 #include <sys/socket.h>
 #include <sys/uio.h>
+#include <fcntl.h>
 
 #include <stdlib.h>
 #include <string.h>
@@ -116,32 +117,32 @@ static int is_trusted_file(int fd)
 
 static int taint_val(int fd)
 {
-	char *fd_type = get_thread_ctx()->files->fd_type;
+	char *fd_type = get_fd_type(fd);
 
-	if ( (fd > 1023) || (fd < 0) )
+	if ( !fd_type )
 		return TAINT_CLEAR;
 
-	if ( fd_type[fd] == FD_UNKNOWN )
+	if ( *fd_type == FD_UNKNOWN )
 	{
 		struct kernel_stat64 s;
 		if ( ( sys_fstat64(fd, &s) < 0 ) || (s.st_mode & __S_IFMT) != __S_IFREG )
-			fd_type[fd] = FD_SOCKET;
+			*fd_type = FD_SOCKET;
 		else
-			fd_type[fd] = FD_FILE;
+			*fd_type = FD_FILE;
 	}
 
-	if (fd_type[fd] == FD_FILE)
+	if (*fd_type == FD_FILE)
 	{
 		if (is_trusted_file(fd))
-			fd_type[fd] = FD_TRUSTED_FILE;
+			*fd_type = FD_TRUSTED_FILE;
 		else
-			fd_type[fd] = FD_UNTRUSTED_FILE;
+			*fd_type = FD_UNTRUSTED_FILE;
 	}
 
-	if (fd_type[fd] == FD_SOCKET)
+	if (*fd_type == FD_SOCKET)
 		return TAINT_SOCKET;
 
-	if (fd_type[fd] == FD_UNTRUSTED_FILE)
+	if (*fd_type == FD_UNTRUSTED_FILE)
 		return TAINT_FILE;
 
 	return TAINT_CLEAR;
@@ -149,8 +150,18 @@ static int taint_val(int fd)
 
 static void set_fd(int fd, int type)
 {
-	if ( (fd < 1024) && (fd > -1) )
-		get_thread_ctx()->files->fd_type[fd] = type;
+	char *fd_type = get_fd_type(fd);
+
+	if (fd_type)
+		*fd_type = type;
+}
+
+/* a duplicate shares the open file, and with it the type */
+static void dup_fd(int newfd, int oldfd)
+{
+	char *fd_type = get_fd_type(oldfd);
+
+	set_fd(newfd, fd_type ? *fd_type : FD_UNKNOWN);
 }
 
 void taint_mem(void *mem, unsigned long size, int type)
@@ -245,7 +256,22 @@ void do_taint(long ret, long call, long arg1, long arg2, long arg3, long arg4, l
 			return;
 		case __NR_dup:
 		case __NR_dup2:
-			set_fd( ret, get_thread_ctx()->files->fd_type[arg1]);
+		case __NR_dup3:
+			dup_fd(ret, arg1);
+			return;
+		case __NR_fcntl:
+		case __NR_fcntl64:
+			if ( (arg2 == F_DUPFD) || (arg2 == F_DUPFD_CLOEXEC) )
+				dup_fd(ret, arg1);
+			return;
+		case __NR_close:
+			/* the number will be reused for something else */
+			set_fd(arg1, FD_UNKNOWN);
+			return;
+		case __NR_accept4:
+			if ( arg2 && arg3 )
+				taint_mem((char *)arg2, *(long *)arg3, TAINT_SOCKADDR);
+			set_fd(ret, FD_SOCKET);
 			return;
 		case __NR_pipe:
 			set_fd( ((long *)arg1)[0], FD_SOCKET);
@@ -262,6 +288,7 @@ void do_taint(long ret, long call, long arg1, long arg2, long arg3, long arg4, l
 						taint_mem((char *)sockargs[1], *(long *)sockargs[2], TAINT_SOCKADDR);
 					return;
 				case SYS_ACCEPT:
+				case SYS_ACCEPT4:
 					if ( (ret >= 0) && sockargs[1] && sockargs[2])
 						taint_mem((char *)sockargs[1], *(long *)sockargs[2], TAINT_SOCKADDR);
 				case SYS_SOCKET:
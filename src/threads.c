@@ -17,10 +17,14 @@
  */
 
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <linux/sched.h>
 #include <sched.h>
+#include <string.h>
+#include <errno.h>
 
 #include "threads.h"
+#include "lib.h"
 #include "syscalls.h"
 #include "runtime.h"
 #include "error.h"
@@ -28,43 +32,96 @@
 #include "jmp_cache.h"
 #include "sigwrap.h"
 
-static thread_ctx_t __attribute__ ((aligned (0x1000))) ctx[MAX_THREADS];
+#define MAX_THREADS (CTX_AREA_MAX/sizeof(thread_ctx_t))
+
+/* Thread contexts live in CTX_AREA, slots [0, n_ctx) have been set up
+ * at some point. Contexts of threads which have exited are kept on the
+ * pool to be handed out again, so we can skip most of init_thread_ctx()
+ */
+static thread_ctx_t *ctx = (thread_ctx_t *)CTX_AREA_START;
+static long n_ctx = 0, max_ctx = 0;
+static long pool[MAX_THREADS], n_pool = 0;
 static sighandler_ctx_t sighandler;
 static file_ctx_t files;
 static long thread_lock;
 
-char ctx_map[MAX_THREADS];
+unsigned long ctx_area_end;
+
+char ctx_map[MAX_THREADS]; /* 1 for contexts in use, 2 while being set up */
 
-static thread_ctx_t *alloc_ctx(void)
+/* *fresh is set to 1 if the context has not been set up before */
+static thread_ctx_t *alloc_ctx(int *fresh)
 {
-	int i;
-	for (i=0; i<MAX_THREADS; i++)
-		if (ctx_map[i] == 0)
-		{
-			ctx_map[i] = 1;
-			return &ctx[i];
-		}
+	long i;
+
+	if (n_pool > 0)
+	{
+		i = pool[--n_pool];
+		*fresh = 0;
+	}
+	else if (n_ctx < max_ctx)
+	{
+		i = n_ctx++;
+		*fresh = 1;
+	}
+	else
+		return NULL;
 
-	return NULL;
+	ctx_map[i] = 2; /* see publish_ctx() */
+	return &ctx[i];
 }
 
 static void free_ctx(thread_ctx_t *c)
 {
 	int me = ((unsigned long)c - (unsigned long)ctx)/sizeof(thread_ctx_t);
 	ctx_map[me] = 0;
+	pool[n_pool++] = me;
 }
 
+/* Give the pages of a context which are only needed by a running thread
+ * back to the system, they are faulted in again (zeroed) when reused.
+ * The scratch stack is left alone, the exiting thread is still on it.
+ */
+static void release_ctx_pages(thread_ctx_t *c)
+{
+	sys_madvise(c->jmp_cache, sizeof(c->jmp_cache), MADV_DONTNEED);
+}
+
+/* after fork(), all other contexts belonged to threads of the parent */
 static void unshare_ctx(thread_ctx_t *c)
 {
 	int me = ((unsigned long)c - (unsigned long)ctx)/sizeof(thread_ctx_t);
-	int i;
-	for (i=0; i<MAX_THREADS; i++)
+	long i;
+
+	n_pool = 0;
+	for (i=n_ctx-1; i>=0; i--)
 		if (i != me)
+		{
+			if (ctx_map[i] == 1)
+			{
+				release_ctx_pages(&ctx[i]);
+				sys_madvise(ctx[i].sigwrap_stack, sizeof(ctx[i].sigwrap_stack), MADV_DONTNEED);
+			}
 			ctx_map[i] = 0;
+			pool[n_pool++] = i;
+		}
 }
 
-static void init_thread_ctx(thread_ctx_t *local_ctx)
+static void publish_ctx(thread_ctx_t *c);
+
+static void init_thread_ctx(thread_ctx_t *local_ctx, int fresh)
 {
+	/* the read-only part is still set up, the jump cache has been
+	 * released when the previous owner went away
+	 */
+	if (!fresh)
+	{
+		local_ctx->fragment_cache.op = NULL;
+		local_ctx->sigdefer_info.saved = 0;
+		publish_ctx(local_ctx);
+		return;
+	}
+
 	long ret = sys_mmap2(local_ctx, sizeof(thread_ctx_t),
 	                     PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_FIXED|MAP_ANONYMOUS, -1, 0);
 
@@ -85,17 +142,178 @@ static void init_thread_ctx(thread_ctx_t *local_ctx)
 
 	sys_mprotect(&local_ctx->fault_page0, 0x1000, PROT_NONE);
 	sys_mprotect(&local_ctx->jit_fragment_page, PG_SIZE, PROT_EXEC|PROT_READ);
+	publish_ctx(local_ctx);
 }
 
+/* counts purge_caches() calls, see quiesce_exit() and int80_emu */
+unsigned long sync_purges = 0;
+
 /* no need for locking, the only risk is doing too much work */
 void purge_caches(char *addr, unsigned long len)
 {
 	int i;
-	for (i=0; i<MAX_THREADS; i++)
+	sync_purges++;
+	clear_shared_cache(addr, len);
+	for (i=0; i<n_ctx; i++)
 		if (ctx_map[i] == 1)
 			clear_jmp_cache(&ctx[i], addr, len);
 }
 
+/* Ranges which other threads remove from their own jump caches when they
+ * leave a quiescent state, purge_gen counts all ranges ever logged.
+ */
+#define PURGE_LOG_SIZE (64)
+
+static struct { char *addr; unsigned long len; } purge_log[PURGE_LOG_SIZE];
+unsigned long purge_gen = 0; /* read by int80_emu */
+static long purge_lock = 0;
+
+/* Like purge_caches(), but without scanning every thread's cache now.
+ * Until a thread catches up, it may still jump to the old jit code, so
+ * the caller must keep that code around until caches_purged() says so.
+ */
+unsigned long purge_caches_lazy(char *addr, unsigned long len)
+{
+	/* the shared cache is not per thread, purge it right away */
+	clear_shared_cache(addr, len);
+
+	mutex_lock(&purge_lock);
+
+	unsigned long gen = purge_gen;
+	purge_log[gen % PURGE_LOG_SIZE].addr = addr;
+	purge_log[gen % PURGE_LOG_SIZE].len = len;
+	commit();
+	purge_gen = gen+1;
+
+	mutex_unlock(&purge_lock);
+
+	return gen+1;
+}
+
+/* true if no thread can use jump cache entries purged in generation gen */
+int caches_purged(unsigned long gen)
+{
+	int i;
+	for (i=0; i<n_ctx; i++)
+		if ( (ctx_map[i] == 1) && !ctx[i].quiescent &&
+		     ((long)(ctx[i].purge_seen - gen) < 0) )
+			return 0;
+
+	return 1;
+}
+
+static void catch_up_purges(thread_ctx_t *local_ctx, unsigned long gen)
+{
+	unsigned long g;
+
+	if (gen - local_ctx->purge_seen <= PURGE_LOG_SIZE)
+		for (g=local_ctx->purge_seen; g!=gen; g++)
+			clear_jmp_cache(local_ctx, purge_log[g % PURGE_LOG_SIZE].addr,
+			                           purge_log[g % PURGE_LOG_SIZE].len);
+
+	commit();
+
+	/* too far behind, or the log wrapped around while we read it */
+	if (purge_gen - local_ctx->purge_seen > PURGE_LOG_SIZE)
+		memset(local_ctx->jmp_cache, 0, sizeof(local_ctx->jmp_cache));
+
+	local_ctx->purge_seen = gen;
+}
+
+/* Jit code may only be freed when no thread can still be running it.
+ *
+ * A thread is quiescent while it is in a syscall, or in the runtime
+ * looking up jump targets: then it holds no pointers into jit code other
+ * than those in its jump cache and the syscall's return address in
+ * jit_eip. When a thread leaves a quiescent state and the jit epoch has
+ * changed, it clears its jump cache, since it may contain stale entries.
+ * (Running code re-adds them by preseeding.)
+ */
+long jit_epoch = 0;
+
+void quiesce_enter(void)
+{
+	thread_ctx_t *local_ctx = get_thread_ctx();
+	local_ctx->sync_purges_seen = sync_purges;
+	local_ctx->quiescent = 1;
+}
+
+/* returns 1 if jit code may have been removed since quiesce_enter() */
+int quiesce_exit(void)
+{
+	thread_ctx_t *local_ctx = get_thread_ctx();
+	int changed = (local_ctx->sync_purges_seen != sync_purges);
+
+	local_ctx->quiescent = 0;
+	commit(); /* pairs with the one in wait_quiescent() */
+
+	long epoch = jit_epoch;
+	if (local_ctx->jit_epoch_seen != epoch)
+	{
+		memset(local_ctx->jmp_cache, 0, sizeof(local_ctx->jmp_cache));
+		local_ctx->jit_epoch_seen = epoch;
+		changed = 1;
+	}
+
+	unsigned long gen = purge_gen;
+	if (local_ctx->purge_seen != gen)
+	{
+		catch_up_purges(local_ctx, gen);
+		changed = 1;
+	}
+
+	return changed;
+}
+
+#define QUIESCE_MAX_YIELDS (10000)
+
+/* Starts a new jit epoch, and waits until every other thread has either
+ * seen it or is quiescent. Only call this with jit_lock held, after
+ * unlinking the code which is to be freed. Returns -1 if some thread
+ * does not leave jit code in time.
+ */
+int wait_quiescent(void)
+{
+	thread_ctx_t *local_ctx = get_thread_ctx();
+	int i, n;
+
+	jit_epoch++;
+	memset(local_ctx->jmp_cache, 0, sizeof(local_ctx->jmp_cache));
+	clear_shared_cache(NULL, ~0UL);
+	local_ctx->jit_epoch_seen = jit_epoch;
+	commit();
+
+	for (n=0; n<QUIESCE_MAX_YIELDS; n++)
+	{
+		for (i=0; i<n_ctx; i++)
+			if ( (ctx_map[i] == 1) && (&ctx[i] != local_ctx) &&
+			     !ctx[i].quiescent && (ctx[i].jit_epoch_seen != jit_epoch) )
+				break;
+
+		if (i == n_ctx)
+			return 0;
+
+		sys_sched_yield();
+	}
+
+	return -1;
+}
+
+/* Makes a new context visible to wait_quiescent() and caches_purged().
+ * Its jump cache is empty, so it has seen every purge and epoch so far,
+ * whatever a previous owner of the context left behind.
+ */
+static void publish_ctx(thread_ctx_t *c)
+{
+	int me = ((unsigned long)c - (unsigned long)ctx)/sizeof(thread_ctx_t);
+
+	c->quiescent = 0;
+	c->jit_epoch_seen = jit_epoch;
+	c->purge_seen = purge_gen;
+	commit();
+	ctx_map[me] = 1;
+}
+
 void protect_ctx(void)
 {
 	sys_mprotect(get_thread_ctx()->jit_fragment_page, PG_SIZE, PROT_EXEC|PROT_READ);
@@ -106,11 +324,85 @@ void unprotect_ctx(void)
 	sys_mprotect(get_thread_ctx()->jit_fragment_page, PG_SIZE, PROT_READ|PROT_WRITE);
 }
 
+/* Returns the type of fd in the file descriptor table, mapping more of
+ * the table if needed, or NULL if fd is out of range. Mapping is
+ * idempotent, threads racing to grow the table just do the same work.
+ */
+char *get_fd_type(long fd)
+{
+	unsigned long size = files.size, new_size;
+
+	if ( (unsigned long)fd < size )
+		return &files.fd_type[fd];
+
+	if ( (unsigned long)fd >= FD_TABLE_MAX )
+		return NULL;
+
+	new_size = PAGE_NEXT(fd+1);
+	if (new_size < 2*size)
+		new_size = 2*size;
+	if (new_size > FD_TABLE_MAX)
+		new_size = FD_TABLE_MAX;
+
+	if (sys_mprotect(files.fd_type, new_size, PROT_READ|PROT_WRITE) < 0)
+		return NULL;
+
+	while ( ( (size = files.size) < new_size ) &&
+	        !__sync_bool_compare_and_swap(&files.size, size, new_size) );
+
+	return &files.fd_type[fd];
+}
+
+/* start out with room for RLIMIT_NOFILE descriptors */
+static void init_fd_table(void)
+{
+	struct rlimit lim;
+
+	files.fd_type = (char *)FD_TABLE_START;
+	files.size = 0;
+
+	if ( (sys_getrlimit(RLIMIT_NOFILE, &lim) < 0) || (lim.rlim_cur == 0) )
+		return;
+
+	if (lim.rlim_cur > FD_TABLE_MAX)
+		lim.rlim_cur = FD_TABLE_MAX;
+
+	get_fd_type(lim.rlim_cur-1);
+}
+
 void init_threads(void)
 {
-	thread_ctx_t *new_ctx = alloc_ctx();
+	int fresh;
+	char c[1];
+
+	/* on a 3G/1G split the stack may be close, leave room for it */
+	long room = (long)(PAGE_BASE(c) - MINEMU_STACK_MIN - PG_SIZE -
+	                   FD_TABLE_MAX - PG_SIZE - CTX_AREA_START);
+
+	if (room > (long)CTX_AREA_MAX)
+		room = CTX_AREA_MAX;
+
+	max_ctx = room / (long)sizeof(thread_ctx_t);
+
+	if (max_ctx < 1)
+		die("init_threads(): no room for thread contexts\n");
+
+	ctx_area_end = CTX_AREA_START + max_ctx*sizeof(thread_ctx_t);
+
+	/* reserve the address space, contexts and the file descriptor table
+	 * are mapped when first used
+	 */
+	long ret = sys_mmap2(MINEMU_END, FD_TABLE_END+PG_SIZE-MINEMU_END, PROT_NONE,
+	                     MAP_PRIVATE|MAP_FIXED|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+
+	if (ret != (long)MINEMU_END)
+		die("init_threads(): mmap() failed\n");
+
+	init_fd_table();
+
+	thread_ctx_t *new_ctx = alloc_ctx(&fresh);
 	mutex_init(&thread_lock);
-	init_thread_ctx(new_ctx);
+	init_thread_ctx(new_ctx, fresh);
 	init_tls(new_ctx, sizeof(thread_ctx_t));
 	unprotect_ctx();
 	altstack_setup();
@@ -133,10 +425,15 @@ long user_clone(unsigned long flags, unsigned long sp, void *parent_tid, void *t
 
 	if (flags & CLONE_VM)
 	{
+		int fresh;
 		mutex_lock(&thread_lock);
-		child_ctx = alloc_ctx();
+		child_ctx = alloc_ctx(&fresh);
 		mutex_unlock(&thread_lock);
-		init_thread_ctx(child_ctx);
+
+		if (child_ctx == NULL)
+			return -EAGAIN;
+
+		init_thread_ctx(child_ctx, fresh);
 		int stack_diff = (long)child_ctx - (long)get_thread_ctx();
 		/* I need to change a "this is the most ugly hack ever" comment somewhere else */
 		ret = clone_relocate_stack(flags, sp, parent_tid, tls, child_tid, stack_diff);
@@ -151,6 +448,8 @@ long user_clone(unsigned long flags, unsigned long sp, void *parent_tid, void *t
 		else if (ret == 0)
 		{
 			init_tls(child_ctx, sizeof(thread_ctx_t));
+			memset(child_ctx->jmp_cache_hits, 0, sizeof(child_ctx->jmp_cache_hits));
+			child_ctx->jmp_cache_misses = 0;
 			unprotect_ctx();
 			altstack_setup();
 			protect_ctx();
@@ -161,7 +460,10 @@ long user_clone(unsigned long flags, unsigned long sp, void *parent_tid, void *t
 		child_ctx = get_thread_ctx();
 		ret = sys_clone(flags, 0, parent_tid, tls, child_tid);
 		if (ret == 0)
+		{
 			unshare_ctx(child_ctx);
+			child_ctx->sigdefer_info.saved = 0;
+		}
 	}
 
 	if (ret == 0 && sp)
@@ -170,9 +472,161 @@ long user_clone(unsigned long flags, unsigned long sp, void *parent_tid, void *t
 	return ret;
 }
 
+/* jump cache counters of threads which have exited */
+static unsigned long exited_hits[JMP_CACHE_WAYS], exited_misses;
+
+static void add_jmp_cache_stats(thread_ctx_t *c, unsigned long *hits, unsigned long *misses)
+{
+	int w;
+	for (w=0; w<JMP_CACHE_WAYS; w++)
+		hits[w] += c->jmp_cache_hits[w];
+
+	*misses += c->jmp_cache_misses;
+}
+
+/* id -1 is the total */
+static void print_jmp_cache_line(int id, unsigned long *hits, unsigned long misses)
+{
+	int w;
+
+	if (id < 0)
+		fd_printf(2, "  jmp_cache total:     misses %u, hits per way:", misses);
+	else
+		fd_printf(2, "  jmp_cache thread %d: misses %u, hits per way:", id, misses);
+
+	for (w=0; w<JMP_CACHE_WAYS; w++)
+		fd_printf(2, " %u", hits[w]);
+	fd_printf(2, "\n");
+}
+
+void print_jmp_cache_stats(void)
+{
+	unsigned long hits[JMP_CACHE_WAYS], misses = exited_misses;
+	int i;
+
+	memcpy(hits, exited_hits, sizeof(hits));
+
+	for (i=0; i<n_ctx; i++)
+		if (ctx_map[i] == 1)
+		{
+			print_jmp_cache_line(i, ctx[i].jmp_cache_hits, ctx[i].jmp_cache_misses);
+			add_jmp_cache_stats(&ctx[i], hits, &misses);
+		}
+
+	print_jmp_cache_line(-1, hits, misses);
+}
+
+/* resident memory of a thread context, in bytes */
+static unsigned long ctx_resident(thread_ctx_t *c)
+{
+	unsigned char vec[(sizeof(thread_ctx_t)+PG_SIZE-1)/PG_SIZE];
+	unsigned long i, n = 0;
+
+	if (sys_mincore(c, sizeof(thread_ctx_t), vec) < 0)
+		return 0;
+
+	for (i=0; i<sizeof(vec); i++)
+		n += vec[i] & 1;
+
+	return n*PG_SIZE;
+}
+
+void print_thread_mem_stats(void)
+{
+	unsigned long total = 0, size;
+	int i;
+
+	for (i=0; i<n_ctx; i++)
+		if (ctx_map[i] == 1)
+		{
+			size = ctx_resident(&ctx[i]);
+			total += size;
+			fd_printf(2, "  thread %d memory:     %uK\n", i, size/1024);
+		}
+
+	fd_printf(2, "  thread memory total: %uK (%d contexts of %uK mapped)\n",
+	          total/1024, n_ctx, sizeof(thread_ctx_t)/1024);
+}
+
+#ifdef MUTEX_STATS
+
+#define MAX_MUTEX_STATS (32)
+
+/* an entry is only updated by the holder of its lock */
+static struct
+{
+	long *lock;
+	char *name;
+	unsigned long acquired, contended, spins, waits;
+	unsigned long long locked_at, held;
+
+} mutex_stats[MAX_MUTEX_STATS];
+
+static unsigned long long rdtsc(void)
+{
+	unsigned long long t;
+	__asm__ __volatile__ ("rdtsc" : "=A" (t));
+	return t;
+}
+
+static int mutex_stats_index(long *lock)
+{
+	int i;
+
+	for (i=0; i<MAX_MUTEX_STATS; i++)
+		if ( (mutex_stats[i].lock == lock) ||
+		     ( (mutex_stats[i].lock == NULL) &&
+		       __sync_bool_compare_and_swap(&mutex_stats[i].lock, NULL, lock) ) )
+			return i;
+
+	return -1;
+}
+
+void mutex_lock_stats(long *lock, char *name)
+{
+	long ret = (mutex_lock)(lock);
+	int i = mutex_stats_index(lock);
+
+	if (i < 0)
+		return;
+
+	mutex_stats[i].name = name;
+	mutex_stats[i].acquired++;
+	mutex_stats[i].contended += ret ? 1 : 0;
+	mutex_stats[i].spins += ret & 0xffff;
+	mutex_stats[i].waits += (unsigned long)ret >> 16;
+	mutex_stats[i].locked_at = rdtsc();
+}
+
+void mutex_unlock_stats(long *lock)
+{
+	int i = mutex_stats_index(lock);
+
+	if (i >= 0)
+		mutex_stats[i].held += rdtsc() - mutex_stats[i].locked_at;
+
+	(mutex_unlock)(lock);
+}
+
+void print_mutex_stats(void)
+{
+	int i;
+
+	for (i=0; i<MAX_MUTEX_STATS && mutex_stats[i].lock; i++)
+		fd_printf(2, "  mutex %s: acquired %u, contended %u, spins %u, "
+		             "waits %u, held %uK cycles\n",
+		          mutex_stats[i].name, mutex_stats[i].acquired,
+		          mutex_stats[i].contended, mutex_stats[i].spins,
+		          mutex_stats[i].waits, (unsigned long)(mutex_stats[i].held/1024));
+}
+
+#endif
+
 void user_exit(long status)
 {
 	mutex_lock(&thread_lock);
+	add_jmp_cache_stats(get_thread_ctx(), exited_hits, &exited_misses);
+	release_ctx_pages(get_thread_ctx());
 	free_ctx(get_thread_ctx());
 	/* do not touch the scratch stack after releasing it */
 	mutex_unlock_exit(status, &thread_lock);
@@ -23,8 +23,14 @@
 #include "sigwrap.h"
 #include "segments.h"
 
-#define JMP_CACHE_SIZE (0x10000)
-#define MAX_THREADS 32
+/* The jump cache consists of sets of JMP_CACHE_WAYS entries, the fast
+ * path in runtime_ijmp only looks at the first way of a set. Since it
+ * computes the index without touching the cpu flags, the cache size is
+ * fixed at 2^16 entries. JMP_CACHE_WAYS can be 1, 2, 4 or 8.
+ */
+#define JMP_CACHE_BITS (16)
+#define JMP_CACHE_SIZE (1<<JMP_CACHE_BITS)
+#define JMP_CACHE_WAYS (4)
 
 typedef struct
 {
@@ -36,10 +42,17 @@ typedef struct
 
 typedef long (*ijmp_t)(void);
 
+/* File descriptor types for taint.c, fd_type points to a reservation of
+ * FD_TABLE_MAX bytes after the thread contexts, of which the first size
+ * bytes are mapped. The table never moves and only grows, so readers
+ * just check size.
+ */
+#define FD_TABLE_MAX (0x100000UL)
+
 typedef struct
 {
-	char fd_type[1024];
-	long lock;
+	char *fd_type;
+	unsigned long size;
 
 } file_ctx_t;
 
@@ -52,6 +65,30 @@ typedef struct
 
 typedef struct thread_ctx_s thread_ctx_t;
 
+/* kernel generated siginfo of deferred signals which could not be queued
+ * again with it, see defer_signal()
+ */
+typedef struct
+{
+	unsigned long saved; /* bit sig-1 is set if info[sig-1] is in use */
+	siginfo_t info[32];
+
+} sigdefer_info_t;
+
+/* the last fragment built by jit_fragment(), it can be run again as long
+ * as the jit code it was made from stays the same
+ */
+#define FRAGMENT_CACHE_MAX (0x200)
+
+typedef struct
+{
+	char *op;
+	long len;
+	char code[FRAGMENT_CACHE_MAX];
+	unsigned short entry[FRAGMENT_CACHE_MAX+2]; /* offsets into jit_fragment_page */
+
+} fragment_cache_t;
+
 struct thread_ctx_s
 {
 	jmp_map_t jmp_cache[JMP_CACHE_SIZE];
@@ -76,7 +113,12 @@ struct thread_ctx_s
 	sighandler_ctx_t *sighandler;             /*   bugs   */
 	stack_t altstack;                         /*    :-)   */
 
-	long scratch_stack[0x2400 - 11 - sizeof(kernel_sigset_t)/sizeof(long)];
+	fragment_cache_t fragment_cache; /* see jit_fragment() */
+	sigdefer_info_t sigdefer_info;
+
+	long scratch_stack[0x2400 - 18 - JMP_CACHE_WAYS - 2*sizeof(kernel_sigset_t)/sizeof(long) -
+	                   sizeof(fragment_cache_t)/sizeof(long) -
+	                   sizeof(sigdefer_info_t)/sizeof(long)];
 
 /* this */
 	long user_esp; /* scratch_stack_top points here */
@@ -94,6 +136,20 @@ struct thread_ctx_s
 	long flags_tmp;
 
 	kernel_sigset_t old_sigset;
+	long sigdefer;          /* see try_defer_signals() */
+	long sigdefer_pending;
+	kernel_sigset_t sigdefer_mask;
+
+	long quiescent;      /* not running jit code, see quiesce_enter() */
+	long jit_epoch_seen;
+	unsigned long purge_seen; /* see purge_caches_lazy() */
+	unsigned long sync_purges_seen;
+
+	/* jump cache hits per way, hits in the first way are only
+	 * counted when built with -DJMP_CACHE_STATS
+	 */
+	unsigned long jmp_cache_hits[JMP_CACHE_WAYS];
+	unsigned long jmp_cache_misses;
 /* gets copied in clone_relocate_stack() as well */
 };
 
@@ -113,11 +169,37 @@ void user_exit(long status);
 long sys_execve_or_die(char *filename, char *argv[], char *envp[]);
 
 void purge_caches(char *addr, unsigned long len);
+unsigned long purge_caches_lazy(char *addr, unsigned long len);
+int caches_purged(unsigned long gen);
+void print_jmp_cache_stats(void);
+void print_thread_mem_stats(void);
+
+extern unsigned long ctx_area_end;
+
+char *get_fd_type(long fd);
+
+extern long jit_epoch;
+
+void quiesce_enter(void);
+int quiesce_exit(void);
+int wait_quiescent(void);
 
 void mutex_init(long *lock);
-void mutex_lock(long *lock);
+long mutex_lock(long *lock);
+int mutex_trylock(long *lock);
 void mutex_unlock(long *lock);
 
+/* with -DMUTEX_STATS, acquisitions, contention and hold times are
+ * counted per lock, named after the expression used to take it
+ */
+#ifdef MUTEX_STATS
+void mutex_lock_stats(long *lock, char *name);
+void mutex_unlock_stats(long *lock);
+void print_mutex_stats(void);
+#define mutex_lock(l) mutex_lock_stats(l, #l)
+#define mutex_unlock(l) mutex_unlock_stats(l)
+#endif
+
 void atomic_clear_8bytes(char *location, char *orig_val);
 
 inline void commit(void)
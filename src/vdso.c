@@ -0,0 +1,231 @@
+
+/* This file is part of minemu
+ *
+ * Copyright 2010-2011 Erik Bosman <erik@minemu.org>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <elf.h>
+#include <errno.h>
+#include <string.h>
+
+#include "vdso.h"
+#include "mm.h"
+#include "lib.h"
+#include "taint.h"
+
+/* The guest gets a copy of the vDSO, the code in it cannot reach the
+ * host's [vvar] page and would otherwise run fully instrumented.
+ * Time calls are serviced by calling the host's vDSO instead.
+ */
+
+enum
+{
+	VDSO_CLOCK_GETTIME,
+	VDSO_CLOCK_GETTIME64,
+	VDSO_GETTIMEOFDAY,
+	VDSO_TIME,
+	VDSO_CLOCK_GETRES,
+	N_VDSO_CALLS,
+};
+
+typedef long (*vdso1_t)(long);
+typedef long (*vdso2_t)(long, long);
+
+static char *vdso_names[N_VDSO_CALLS] =
+{
+	[VDSO_CLOCK_GETTIME]   = "__vdso_clock_gettime",
+	[VDSO_CLOCK_GETTIME64] = "__vdso_clock_gettime64",
+	[VDSO_GETTIMEOFDAY]    = "__vdso_gettimeofday",
+	[VDSO_TIME]            = "__vdso_time",
+	[VDSO_CLOCK_GETRES]    = "__vdso_clock_getres",
+};
+
+/* __kernel_vsyscall in the guest's copy */
+char *kernel_vsyscall;
+
+static unsigned long host[N_VDSO_CALLS];
+static char *guest[N_VDSO_CALLS];
+
+static int user_range(long addr, unsigned long size)
+{
+	return (addr != 0) && ((unsigned long)addr < USER_END) &&
+	       (size <= USER_END-(unsigned long)addr);
+}
+
+static long vdso_clock_gettime_size(int call, long *args, unsigned long size)
+{
+	if ( !user_range(args[1], size) )
+		return -EFAULT;
+
+	long ret = ((vdso2_t)host[call])(args[0], args[1]);
+
+	if (ret == 0)
+		taint_mem((char *)args[1], size, TAINT_CLEAR);
+
+	return ret;
+}
+
+static long vdso_clock_gettime(long *args)
+{
+	return vdso_clock_gettime_size(VDSO_CLOCK_GETTIME, args, 8);
+}
+
+static long vdso_clock_gettime64(long *args)
+{
+	return vdso_clock_gettime_size(VDSO_CLOCK_GETTIME64, args, 16);
+}
+
+static long vdso_clock_getres(long *args)
+{
+	if ( args[1] == 0 )
+		return ((vdso2_t)host[VDSO_CLOCK_GETRES])(args[0], 0);
+
+	return vdso_clock_gettime_size(VDSO_CLOCK_GETRES, args, 8);
+}
+
+static long vdso_gettimeofday(long *args)
+{
+	if ( (args[0] && !user_range(args[0], 8)) ||
+	     (args[1] && !user_range(args[1], 8)) )
+		return -EFAULT;
+
+	long ret = ((vdso2_t)host[VDSO_GETTIMEOFDAY])(args[0], args[1]);
+
+	if (ret == 0)
+	{
+		if (args[0])
+			taint_mem((char *)args[0], 8, TAINT_CLEAR);
+		if (args[1])
+			taint_mem((char *)args[1], 8, TAINT_CLEAR);
+	}
+
+	return ret;
+}
+
+static long vdso_time(long *args)
+{
+	if ( args[0] && !user_range(args[0], 4) )
+		return -EFAULT;
+
+	/* *tloc is left alone if the call fails */
+	long ret = ((vdso1_t)host[VDSO_TIME])(0);
+
+	if ( ((unsigned long)ret < -4095UL) && args[0] )
+	{
+		*(long *)args[0] = ret;
+		taint_mem((char *)args[0], 4, TAINT_CLEAR);
+	}
+
+	return ret;
+}
+
+static vdso_func_t vdso_funcs[N_VDSO_CALLS] =
+{
+	[VDSO_CLOCK_GETTIME]   = vdso_clock_gettime,
+	[VDSO_CLOCK_GETTIME64] = vdso_clock_gettime64,
+	[VDSO_GETTIMEOFDAY]    = vdso_gettimeofday,
+	[VDSO_TIME]            = vdso_time,
+	[VDSO_CLOCK_GETRES]    = vdso_clock_getres,
+};
+
+static Elf32_Ehdr *vdso_ehdr(unsigned long image)
+{
+	Elf32_Ehdr *hdr = (Elf32_Ehdr *)image;
+
+	if ( (image == 0) ||
+	     (memcmp(hdr->e_ident, ELFMAG, SELFMAG) != 0) ||
+	     (hdr->e_ident[EI_CLASS] != ELFCLASS32) ||
+	     (hdr->e_phentsize != sizeof(Elf32_Phdr)) ||
+	     (hdr->e_shentsize != sizeof(Elf32_Shdr)) )
+		return NULL;
+
+	return hdr;
+}
+
+/* size of the vDSO image, including the section headers */
+unsigned long vdso_image_size(unsigned long image)
+{
+	Elf32_Ehdr *hdr = vdso_ehdr(image);
+	unsigned long i, size = PG_SIZE;
+
+	if (hdr == NULL)
+		return size;
+
+	Elf32_Phdr *phdr = (Elf32_Phdr *)(image + hdr->e_phoff);
+	for (i=0; i<hdr->e_phnum; i++)
+		if ( (phdr[i].p_type == PT_LOAD) && (phdr[i].p_offset+phdr[i].p_filesz > size) )
+			size = phdr[i].p_offset+phdr[i].p_filesz;
+
+	if (hdr->e_shoff+hdr->e_shnum*sizeof(Elf32_Shdr) > size)
+		size = hdr->e_shoff+hdr->e_shnum*sizeof(Elf32_Shdr);
+
+	if (size > VDSO_MAX_SIZE)
+		return PG_SIZE;
+
+	return PAGE_NEXT(size);
+}
+
+void init_vdso_calls(unsigned long copy, unsigned long orig)
+{
+	Elf32_Ehdr *hdr = vdso_ehdr(orig);
+	unsigned long i, j, n_sym, load_addr = 0;
+
+	if (hdr == NULL)
+		return;
+
+	Elf32_Phdr *phdr = (Elf32_Phdr *)(orig + hdr->e_phoff);
+	for (i=0; i<hdr->e_phnum; i++)
+		if ( (phdr[i].p_type == PT_LOAD) && (phdr[i].p_offset == 0) )
+			load_addr = phdr[i].p_vaddr;
+
+	Elf32_Shdr *shdr = (Elf32_Shdr *)(orig + hdr->e_shoff);
+	for (i=0; i<hdr->e_shnum; i++)
+	{
+		if ( (shdr[i].sh_type != SHT_DYNSYM) || (shdr[i].sh_link >= hdr->e_shnum) )
+			continue;
+
+		Elf32_Sym *sym = (Elf32_Sym *)(orig + shdr[i].sh_offset);
+		char *strtab = (char *)(orig + shdr[shdr[i].sh_link].sh_offset);
+		n_sym = shdr[i].sh_size / sizeof(Elf32_Sym);
+
+		for (; n_sym; n_sym--, sym++)
+		{
+			if ( (sym->st_shndx == SHN_UNDEF) || (ELF32_ST_TYPE(sym->st_info) != STT_FUNC) )
+				continue;
+
+			if ( strcmp(&strtab[sym->st_name], "__kernel_vsyscall") == 0 )
+				kernel_vsyscall = (char *)copy + sym->st_value - load_addr;
+
+			for (j=0; j<N_VDSO_CALLS; j++)
+				if ( strcmp(&strtab[sym->st_name], vdso_names[j]) == 0 )
+				{
+					host[j] = orig + sym->st_value - load_addr;
+					guest[j] = (char *)copy + sym->st_value - load_addr;
+				}
+		}
+		return;
+	}
+}
+
+vdso_func_t get_vdso_func(char *addr)
+{
+	int i;
+
+	for (i=0; i<N_VDSO_CALLS; i++)
+		if ( guest[i] && (guest[i] == addr) )
+			return vdso_funcs[i];
+
+	return NULL;
+}
@@ -0,0 +1,33 @@
+
+/* This file is part of minemu
+ *
+ * Copyright 2010-2011 Erik Bosman <erik@minemu.org>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef VDSO_H
+#define VDSO_H
+
+/* guest vDSO entry points which are serviced by a native call into the
+ * host's vDSO, args points to the guest's arguments on the user stack
+ */
+typedef long (*vdso_func_t)(long *args);
+
+extern char *kernel_vsyscall;
+
+unsigned long vdso_image_size(unsigned long image);
+void init_vdso_calls(unsigned long copy, unsigned long orig);
+vdso_func_t get_vdso_func(char *addr);
+
+#endif /* VDSO_H */
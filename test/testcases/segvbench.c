@@ -0,0 +1,73 @@
+/* SIGSEGV driven write barrier, run natively and under minemu to compare.
+ *
+ * Every iteration write-protects a page and takes a fault on the next
+ * store, the handler unprotects it again, like a garbage collector would.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+static char *page;
+static long page_size;
+static volatile long faults;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+static void segv_handler(int sig, siginfo_t *info, void *uc)
+{
+	if ( ((char *)info->si_addr < page) || ((char *)info->si_addr >= page+page_size) )
+		abort();
+
+	faults++;
+	mprotect(page, page_size, PROT_READ|PROT_WRITE);
+}
+
+static void bench(char *name, int fault, long n)
+{
+	long i;
+	uint64_t start = now_ns();
+
+	for (i=0; i<n; i++)
+	{
+		/* same syscall either way, only one of them faults */
+		mprotect(page, page_size, fault ? PROT_READ : PROT_READ|PROT_WRITE);
+		*(volatile long *)&page[(i*sizeof(long))%page_size] = i;
+	}
+
+	uint64_t t = now_ns() - start;
+	printf("%-10s %8ld iterations, %6llu ns/iteration\n", name, n, (unsigned long long)(t/n));
+}
+
+int main(int argc, char **argv)
+{
+	long n = argc > 1 ? atol(argv[1]) : 100000;
+	struct sigaction act = { .sa_sigaction = segv_handler, .sa_flags = SA_SIGINFO };
+
+	page_size = sysconf(_SC_PAGESIZE);
+	page = mmap(NULL, page_size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (page == MAP_FAILED)
+		return 1;
+
+	sigaction(SIGSEGV, &act, NULL);
+
+	bench("mprotect", 0, n);
+	bench("fault", 1, n);
+
+	if (faults != n)
+	{
+		printf("expected %ld faults, got %ld\n", n, faults);
+		return 1;
+	}
+
+	return 0;
+}
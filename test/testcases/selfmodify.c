@@ -0,0 +1,194 @@
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+typedef int (*func_t)(void);
+
+/* mov $imm, %eax ; ret */
+static void gen_ret_imm(unsigned char *p, int imm)
+{
+	p[0] = 0xb8;
+	memcpy(&p[1], &imm, sizeof(imm));
+	p[5] = 0xc3;
+}
+
+static void check(unsigned char *code, int expected)
+{
+	func_t func;
+	*(unsigned char **)(&func) = code;
+	int ret = func();
+
+	if (ret != expected)
+	{
+		printf("stale code: got %d, expected %d\n", ret, expected);
+		exit(EXIT_FAILURE);
+	}
+}
+
+static unsigned char *map_code(int fd, int prot)
+{
+	unsigned char *code = mmap(NULL, 4096, prot, MAP_PRIVATE|(fd<0 ? MAP_ANONYMOUS : 0), fd, 0);
+
+	if (code == MAP_FAILED)
+	{
+		perror("mmap");
+		exit(EXIT_FAILURE);
+	}
+
+	return code;
+}
+
+/* anonymous rwx memory, rewritten over and over */
+static void test_anonymous(void)
+{
+	unsigned char *code = map_code(-1, PROT_READ|PROT_WRITE|PROT_EXEC);
+	int i;
+
+	for (i=0; i<1000; i++)
+	{
+		gen_ret_imm(code, i);
+		check(code, i);
+	}
+
+	munmap(code, 4096);
+}
+
+/* code from a file, which may come from the jit cache, made writable
+ * after it has run
+ */
+static void test_file(void)
+{
+	char name[] = "/tmp/selfmodifyXXXXXX";
+	unsigned char buf[4096];
+	int fd = mkstemp(name), i;
+
+	if (fd < 0)
+	{
+		perror("mkstemp");
+		exit(EXIT_FAILURE);
+	}
+
+	unlink(name);
+	memset(buf, 0xc3, sizeof(buf));
+	gen_ret_imm(buf, -1);
+
+	if (write(fd, buf, sizeof(buf)) != sizeof(buf))
+	{
+		perror("write");
+		exit(EXIT_FAILURE);
+	}
+
+	unsigned char *code = map_code(fd, PROT_READ|PROT_EXEC);
+	check(code, -1);
+
+	if (mprotect(code, 4096, PROT_READ|PROT_WRITE|PROT_EXEC) < 0)
+	{
+		perror("mprotect");
+		exit(EXIT_FAILURE);
+	}
+
+	for (i=0; i<100; i++)
+	{
+		gen_ret_imm(code, i);
+		check(code, i);
+	}
+
+	munmap(code, 4096);
+	close(fd);
+}
+
+static unsigned char *thread_code;
+static int thread_imm;
+
+static void *patch_thread(void *_)
+{
+	gen_ret_imm(thread_code, thread_imm);
+	return NULL;
+}
+
+/* code which has run in one thread is rewritten by another */
+static void test_thread(void)
+{
+	pthread_t id;
+	int i;
+
+	thread_code = map_code(-1, PROT_READ|PROT_WRITE|PROT_EXEC);
+	gen_ret_imm(thread_code, -1);
+	check(thread_code, -1);
+
+	for (i=0; i<100; i++)
+	{
+		thread_imm = i;
+		pthread_create(&id, NULL, patch_thread, NULL);
+		pthread_join(id, NULL);
+		check(thread_code, i);
+	}
+
+	munmap(thread_code, 4096);
+}
+
+static sigjmp_buf segv_env;
+static volatile int segv_count;
+
+static void segv_handler(int sig)
+{
+	segv_count++;
+	siglongjmp(segv_env, 1);
+}
+
+static void (*current_handler(void))(int)
+{
+	struct sigaction act;
+	sigaction(SIGSEGV, NULL, &act);
+	return act.sa_handler;
+}
+
+/* writes to code may not use up a one-shot SIGSEGV handler */
+static void test_resethand(void)
+{
+	unsigned char *code = map_code(-1, PROT_READ|PROT_WRITE|PROT_EXEC),
+	              *ro = map_code(-1, PROT_READ);
+	struct sigaction act = { .sa_handler = segv_handler, .sa_flags = SA_RESETHAND };
+
+	sigaction(SIGSEGV, &act, NULL);
+
+	gen_ret_imm(code, -1);
+	check(code, -1);
+	gen_ret_imm(code, 1);
+	check(code, 1);
+
+	if ( (segv_count != 0) || (current_handler() != segv_handler) )
+	{
+		printf("code write reached the SIGSEGV handler\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (sigsetjmp(segv_env, 1) == 0)
+		*(volatile char *)ro = 0;
+
+	if ( (segv_count != 1) || (current_handler() != SIG_DFL) )
+	{
+		printf("SA_RESETHAND handler not run once and reset\n");
+		exit(EXIT_FAILURE);
+	}
+
+	munmap(code, 4096);
+	munmap(ro, 4096);
+}
+
+int main(void)
+{
+	test_anonymous();
+	test_file();
+	test_thread();
+	test_resethand();
+
+	printf("self-modifying code ok\n");
+	exit(EXIT_SUCCESS);
+}
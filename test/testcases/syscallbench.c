@@ -0,0 +1,46 @@
+/* Syscall overhead, run natively and under minemu to compare.
+ *
+ * getppid() takes int80_emu's fast path, brk() is always emulated.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/syscall.h>
+
+static long int80(long nr, long arg)
+{
+	long ret;
+	__asm__ __volatile__ ("int $0x80" : "=a" (ret) : "a" (nr), "b" (arg) : "memory");
+	return ret;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+static void bench(char *name, long nr, long arg, long n)
+{
+	long i;
+	uint64_t start = now_ns();
+
+	for (i=0; i<n; i++)
+		int80(nr, arg);
+
+	uint64_t t = now_ns() - start;
+	printf("%-10s %8ld calls, %6llu ns/call\n", name, n, (unsigned long long)(t/n));
+}
+
+int main(int argc, char **argv)
+{
+	long n = argc > 1 ? atol(argv[1]) : 1000000;
+
+	bench("getppid", SYS_getppid, 0, n);
+	bench("brk", SYS_brk, 0, n/10);
+
+	return 0;
+}